@@ -0,0 +1,253 @@
+// vim: ts=3:sw=3:expandtab:sts=3
+//
+// bench.c - JTAG throughput benchmark for tjtag
+//
+// Runs the JTAG, EJTAG and flash layers of tjtag.c against the simulated
+// target of sim.h and reports how fast each of them goes, both as a table
+// and as CSV.  Build and run with 'make bench'.
+//
+// The Pi GPIO kernel is also run, against plain memory instead of the GPIO
+// block, to count the SET/CLR writes it issues per TCK.
+//
+// Every figure comes in two flavours.  TCK per operation, and operations
+// per second at the simulated TCK rate (/simtck, 1 MHz unless told
+// otherwise), are exact and do not depend on the machine running the
+// benchmark: they are the numbers to compare between builds.  Host
+// seconds show what the C code itself costs on this machine.
+
+#define SIM_GPIO
+#define main tjtag_main
+#include "tjtag.c"
+#undef main
+
+#define BENCH_BITS          (1 << 23)
+#define BENCH_SCANS         200000
+#define BENCH_WORDS         16384
+#define BENCH_PRACC_WORDS   2048
+#define BENCH_BLOCKS        4
+#define BENCH_PROGRAM_BYTES 4096
+#define BENCH_RAM           0x80100000
+
+static FILE *bench_out;
+static FILE *bench_csv;
+
+static uint64_t           bench_tck;
+static unsigned long long bench_ns;
+
+static void bench_start(void)
+{
+    bench_tck = sim_tck_cycles;
+    bench_ns  = clock_ns();
+}
+
+static void bench_stop(const char *what, const char *mode, const char *unit, double count)
+{
+    double host = (clock_ns() - bench_ns) / 1e9;
+    double tck  = (double)(sim_tck_cycles - bench_tck);
+    double target = tck / (sim_tck_khz * 1000.0);
+
+    fprintf(bench_out, "%-12s %-10s %-7s %10.0f %14.0f %12.1f %14.0f %14.0f %9.3f\n",
+            what, mode, unit, count, tck, tck / count, target ? count / target : 0.0, host ? count / host : 0.0, host);
+    fprintf(bench_csv, "%s,%s,%s,%.0f,%.0f,%.3f,%.3f,%.3f,%.6f\n",
+            what, mode, unit, count, tck, tck / count, target ? count / target : 0.0, host ? count / host : 0.0, host);
+    fflush(bench_out);
+}
+
+// The part of main() that gets a target halted and its flash probed
+static void bench_attach(char *flash)
+{
+    sim_flash_name = flash;
+
+    chip_detect();
+    check_ejtag_features();
+    test_reset();
+
+    set_instr(INSTR_CONTROL);
+    WriteData(PRRST | PERRST);
+    WriteData(0);
+
+    set_instr(INSTR_CONTROL);
+    ctrl_reg = ReadWriteData(PRACC | PROBEN | SETDEV | JTAGBRK);
+    ReadWriteData(PRACC | PROBEN | SETDEV);
+
+    ejtag_write(0xb8000080, 0);
+    isbrcm();
+    sflash_probe();
+}
+
+static void bench_jtag(void)
+{
+    static unsigned char idle[SCAN_BYTES(BENCH_BITS)];
+    int i;
+
+    tap_goto(TAP_IDLE);
+    bench_start();
+    shift_bits(idle, idle, NULL, BENCH_BITS);
+    bench_stop("shift", "-", "bits", BENCH_BITS);
+
+    bench_start();
+    for (i = 0; i < BENCH_SCANS; i++)
+        set_instr((i & 1) ? INSTR_DATA : INSTR_ADDRESS);
+    bench_stop("ir_scan", "-", "scans", BENCH_SCANS);
+
+    bench_start();
+    for (i = 0; i < BENCH_SCANS; i++)
+        ReadWriteData(i);
+    bench_stop("dr_scan", "-", "scans", BENCH_SCANS);
+}
+
+// GPIO writes per TCK of the Pi kernel, TDI random and TMS low as in the
+// body of a long DR scan, then both pins idle
+static void bench_gpio(void)
+{
+    static unsigned char tms[SCAN_BYTES(BENCH_BITS)], tdi[SCAN_BYTES(BENCH_BITS)];
+    const char *mode[2] = { "random", "idle" };
+    unsigned long long start;
+    double host, per_tck[2];
+    int i, pass;
+
+    for (i = 0; i < 2; i++)
+    {
+        cable_pins[i][0] = i << TMS;
+        cable_pins[i][1] = (i << TMS) | (1 << TDI);
+    }
+
+    srand(1);
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < sizeof(tdi); i++)
+            tdi[i] = pass ? 0 : rand();
+
+        pi_level    = 0;
+        gpio_writes = 0;
+        start = clock_ns();
+        shift_bits_pi(tms, tdi, NULL, BENCH_BITS);
+        host = (clock_ns() - start) / 1e9;
+
+        fprintf(bench_out, "%-12s %-10s %-7s %10lu %14d %12.3f %14s %14.0f %9.3f\n",
+                "gpio_pi", mode[pass], "writes", gpio_writes, BENCH_BITS, (double)BENCH_BITS / gpio_writes,
+                "-", host ? gpio_writes / host : 0.0, host);
+        fprintf(bench_csv, "%s,%s,%s,%lu,%d,%.3f,,%.3f,%.6f\n",
+                "gpio_pi", mode[pass], "writes", gpio_writes, BENCH_BITS, (double)BENCH_BITS / gpio_writes,
+                host ? gpio_writes / host : 0.0, host);
+        per_tck[pass] = (double)gpio_writes / BENCH_BITS;
+    }
+    fprintf(bench_out, "(Pi GPIO kernel: %.2f SET/CLR writes per TCK with random TDI, %.2f idle)\n",
+            per_tck[0], per_tck[1]);
+
+    cable_select();
+}
+
+static void bench_reads(const char *mode, int words, int single)
+{
+    static unsigned int buf[BENCH_WORDS];
+    int i;
+
+    if (single)
+    {
+        bench_start();
+        for (i = 0; i < words / 8; i++)
+            buf[i] = ejtag_read(BENCH_RAM + 4 * i);
+        bench_stop("read_word", mode, "words", words / 8);
+    }
+
+    bench_start();
+    for (i = 0; i < words; i += BURST_WORDS)
+        ejtag_read_block(BENCH_RAM + 4 * i, buf + i, BURST_WORDS);
+    bench_stop("read_block", mode, "words", words);
+}
+
+static void bench_flash(char *flash)
+{
+    unsigned int addr, buf[WRITE_BUFFER_MAX / 4];
+    int i, dma;
+    char mode[16];
+
+    for (dma = 1; dma >= 0; dma--)
+    {
+        bench_attach(flash);
+        USE_DMA = dma;
+        USE_ALL = dma && !force_noall;
+        snprintf(mode, sizeof(mode), "%s%s", flash, dma ? "" : "/pa");
+
+        if (cmd_type == 0)
+        {
+            fprintf(bench_out, "*** %s flash was not detected ***\n", flash);
+            lpt_closeport();
+            continue;
+        }
+
+        bench_start();
+        for (i = 1; i <= BENCH_BLOCKS; i++)
+            sflash_erase_block(blocks[i]);
+        bench_stop("erase", mode, "blocks", BENCH_BLOCKS);
+
+        bench_start();
+        if (write_buffer)
+        {
+            for (addr = blocks[1]; addr < blocks[1] + BENCH_PROGRAM_BYTES; addr += write_buffer)
+            {
+                for (i = 0; i < write_buffer / 4; i++)
+                    buf[i] = addr + 4 * i;
+                sflash_write_buffer(addr, buf, write_buffer / 4);
+            }
+            sflash_buffer_check(blocks[1]);
+        }
+        else
+        {
+            if (flash_flags & FLASH_F_BYPASS) unlock_bypass();
+            for (addr = blocks[1]; addr < blocks[1] + BENCH_PROGRAM_BYTES; addr += 4)
+                sflash_write_word(addr, addr);
+            if (bypass_mode) unlock_bypass_reset();
+        }
+        sflash_reset();
+        bench_stop("program", mode, "bytes", BENCH_PROGRAM_BYTES);
+
+        lpt_closeport();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static char *flashes[] = { "amd", "sst", "bsc", "scs", "spi", "s29gl", "eon" };
+    int i;
+
+    bench_out = fdopen(dup(1), "w");
+    bench_csv = fopen((argc > 1) ? argv[1] : "bench.csv", "w");
+    if (!bench_out || !bench_csv)
+    {
+        perror("bench");
+        return 1;
+    }
+
+    // tjtag talks a lot, keep it out of the table
+    if (!freopen("/dev/null", "w", stdout))
+        return 1;
+
+    fprintf(bench_out, "Simulated TCK %u kHz\n\n", sim_tck_khz);
+    fprintf(bench_out, "%-12s %-10s %-7s %10s %14s %12s %14s %14s %9s\n",
+            "benchmark", "mode", "unit", "count", "TCK", "TCK/unit", "units/s", "host units/s", "host s");
+    fprintf(bench_csv, "benchmark,mode,unit,count,tck,tck_per_unit,units_per_s,host_units_per_s,host_s\n");
+
+    bench_attach("amd");
+    bench_jtag();
+    bench_gpio();
+
+    bench_reads("dma", BENCH_WORDS, 1);
+    USE_ALL = 0;
+    bench_reads("dma/noall", BENCH_WORDS, 0);
+    USE_DMA = 0;
+    bench_reads("pracc", BENCH_PRACC_WORDS, 1);
+    USE_FASTDATA = (ejtag_version >= 2);
+    bench_reads("fastdata", BENCH_WORDS, 0);
+    ejtag_fastdata_release();
+    USE_FASTDATA = 0;
+    lpt_closeport();
+
+    for (i = 0; i < sizeof(flashes) / sizeof(flashes[0]); i++)
+        bench_flash(flashes[i]);
+
+    fprintf(bench_out, "\nCSV written to %s\n", (argc > 1) ? argv[1] : "bench.csv");
+    fclose(bench_csv);
+    return 0;
+}
@@ -0,0 +1,1270 @@
+// vim: ts=3:sw=3:expandtab:sts=3
+//
+// sim.h - Simulated EJTAG target for tjtag
+//
+// A software stand-in for a router hooked to the cable.  It models the
+// IEEE 1149.1 TAP, the EJTAG registers tjtag.c uses (IDCODE, IMPCODE,
+// ADDRESS, DATA, CONTROL, ALL, FASTDATA), DMA and PrAcc accesses (the
+// latter by interpreting the debug modules on a tiny MIPS core), and a
+// sparse memory map with a flash chip behind the usual flash window.
+// Every TCK edge is counted so that changes to the JTAG layers can be
+// compared cycle for cycle without hardware.
+//
+// Built in with 'make sim', which takes the place of the cable.
+
+// --- Simulated Target ---
+#define SIM_IDCODE        0x0535217F     // Broadcom BCM5352 Rev 1 CPU
+#define SIM_IRLEN         8
+#define SIM_IMPCODE       0x40400000     // EJTAG 2.6, ASID_8, DMA capable
+
+#define SIM_DMSEG_START   0xFF200000
+#define SIM_DMSEG_END     0xFF2FFFFF
+#define SIM_DRSEG_START   0xFF300000
+#define SIM_DRSEG_END     0xFF3FFFFF
+#define SIM_FASTDATA_END  0xFF20000F
+
+#define SIM_PAGE_SHIFT    12
+#define SIM_PAGE_SIZE     (1 << SIM_PAGE_SHIFT)
+#define SIM_PAGES         (0x20000000 >> SIM_PAGE_SHIFT)
+
+enum
+{
+    SIM_TLR, SIM_RTI,
+    SIM_SELDR, SIM_CAPDR, SIM_SHIFTDR, SIM_EXIT1DR, SIM_PAUSEDR, SIM_EXIT2DR, SIM_UPDDR,
+    SIM_SELIR, SIM_CAPIR, SIM_SHIFTIR, SIM_EXIT1IR, SIM_PAUSEIR, SIM_EXIT2IR, SIM_UPDIR
+};
+
+// next state for TMS = 0 / TMS = 1
+static const unsigned char sim_tap_next[16][2] =
+{
+    { SIM_RTI,     SIM_TLR     },   // Test-Logic-Reset
+    { SIM_RTI,     SIM_SELDR   },   // Run-Test/Idle
+    { SIM_CAPDR,   SIM_SELIR   },   // Select-DR-Scan
+    { SIM_SHIFTDR, SIM_EXIT1DR },   // Capture-DR
+    { SIM_SHIFTDR, SIM_EXIT1DR },   // Shift-DR
+    { SIM_PAUSEDR, SIM_UPDDR   },   // Exit1-DR
+    { SIM_PAUSEDR, SIM_EXIT2DR },   // Pause-DR
+    { SIM_SHIFTDR, SIM_UPDDR   },   // Exit2-DR
+    { SIM_RTI,     SIM_SELDR   },   // Update-DR
+    { SIM_CAPIR,   SIM_TLR     },   // Select-IR-Scan
+    { SIM_SHIFTIR, SIM_EXIT1IR },   // Capture-IR
+    { SIM_SHIFTIR, SIM_EXIT1IR },   // Shift-IR
+    { SIM_PAUSEIR, SIM_UPDIR   },   // Exit1-IR
+    { SIM_PAUSEIR, SIM_EXIT2IR },   // Pause-IR
+    { SIM_SHIFTIR, SIM_UPDIR   },   // Exit2-IR
+    { SIM_RTI,     SIM_SELDR   }    // Update-IR
+};
+
+enum { SIM_NONE, SIM_FETCH, SIM_LOAD, SIM_STORE };
+
+typedef struct _sim_cpu_type
+{
+    int            debug;         // in debug mode
+    unsigned int   pc, npc;
+    unsigned int   r[32];
+    unsigned int   depc;
+    int            pend;          // pending processor access (SIM_FETCH...)
+    unsigned int   pend_addr;
+    int            pend_size;
+    int            pend_signed;
+    int            pend_rt;
+} sim_cpu_type;
+
+// Flash families, one per tjtag cmd_type
+enum { SIM_AMD, SIM_SST, SIM_BSC, SIM_SCS, SIM_SPI };
+
+// Typical datasheet timings in ns, applied on the virtual clock
+typedef struct _sim_chip_type
+{
+    char          *name;          // /simflash:<name>
+    int            kind;
+    unsigned int   vendid;
+    unsigned int   devid;
+    unsigned int   size;
+    unsigned int   regions[4][2]; // block count, block size
+    uint64_t       t_program;     // one word (SPI: one page program, plus t_byte per byte)
+    uint64_t       t_byte;
+    uint64_t       t_erase;       // one sector / block
+    uint64_t       t_chip;        // whole chip
+    uint64_t       t_unlock;      // Intel clear block lock-bits
+    unsigned int   subid;         // Spansion extended id (0 if none)
+    unsigned int   write_buffer;  // Write-to-Buffer size in bytes (0 if none)
+    uint64_t       t_buffer;      // one write buffer, however full
+} sim_chip_type;
+
+static sim_chip_type sim_chip_list[] =
+{
+    { "amd", SIM_AMD, 0x0001, 0x22F6, size4MB, { { 63, size64K }, { 8, size8K } },          // AMD 29LV320DT
+      9000, 0, 700000000, 45000000000ULL, 0 },
+    { "sst", SIM_SST, 0x00BF, 0x235A, size4MB, { { 64, size64K } },                         // SST39VF3202
+      7000, 0, 18000000, 40000000, 0 },
+    { "bsc", SIM_BSC, 0x0089, 0x88C4, size4MB, { { 63, size64K }, { 8, size8K } },          // Intel 28F320C3 TopB
+      12000, 0, 800000000, 0, 0 },
+    { "scs", SIM_SCS, 0x0089, 0x0016, size4MB, { { 32, size128K } },                        // Intel 28F320J3
+      210000, 0, 1000000000, 0, 500000000, 0, 32, 218000 },
+    { "spi", SIM_SPI, 0x0020, 0x2016, size4MB, { { 64, size64K } },                         // ST M25P32
+      400000, 3900, 1000000000, 34000000000ULL, 0 },
+    { "eon", SIM_AMD, 0x007F, 0x22F6, size4MB, { { 63, size64K }, { 8, size8K } },          // EON EN29LV320 TopB
+      8000, 0, 500000000, 35000000000ULL, 0 },
+    { "s29gl", SIM_AMD, 0x0001, 0x227E, size4MB, { { 63, size64K }, { 8, size8K } },      // Spansion S29GL032M TopB
+      60000, 0, 500000000, 32000000000ULL, 0, 0x1A01, 32, 240000 },
+    { 0 }
+};
+
+enum { SIM_OP_NONE, SIM_OP_PROGRAM, SIM_OP_ERASE };
+
+#define SIM_ERASE_WINDOW    50000       // AMD sector erase timeout, more sectors may be queued
+#define SIM_ERASE_QUEUE     1024
+#define SIM_WRITE_BUFFER    256         // largest write buffer modelled, in bytes
+
+typedef struct _sim_flash_type
+{
+    sim_chip_type *chip;
+    unsigned int   base;          // physical base of the flash window
+    unsigned int   size;
+    unsigned int   subid;         // Spansion/Winbond extended id (0 if none)
+    unsigned char *mem;
+    int            state;
+    int            bypass;
+
+    int            op;            // embedded operation in progress (SIM_OP_...)
+    uint64_t       busy_until;    // virtual ns it completes at
+    uint64_t       window_until;  // AMD: sector erase timeout still open until
+    unsigned int   dq7;           // AMD/SST: DQ7 while programming
+    int            toggle;        // AMD/SST: DQ6
+    unsigned int   queue[SIM_ERASE_QUEUE][2];   // AMD/SST erases to apply: start, size
+    int            queued;
+    unsigned int   buf[SIM_WRITE_BUFFER / 2][2];  // AMD Write-to-Buffer: offset, halfword loaded
+    unsigned int   buf_sector;    // sector the buffer was opened on
+    unsigned int   buf_count;     // halfwords announced
+    unsigned int   buf_loaded;
+    int            aborted;       // AMD: buffer aborted, DQ1 up until the abort reset
+    unsigned int   status;        // Intel status register / SPI status register
+
+    unsigned int   spi_ctl;       // Broadcom serial flash controller
+    unsigned int   spi_addr;
+    unsigned int   spi_data;
+    uint64_t       spi_busy_until;
+
+    uint64_t       programs;      // program operations started
+    uint64_t       program_bytes;
+    uint64_t       erases;        // sectors / blocks erased (a chip erase counts once)
+    uint64_t       program_polls; // status reads, put down to the last operation started
+    uint64_t       erase_polls;
+    uint64_t       busy_polls;    // status reads that still saw it busy
+    int            last_op;
+    int            polling;       // AMD/SST: the next ready read still ends a poll
+} sim_flash_type;
+
+enum
+{
+    SIM_FL_READ, SIM_FL_UNLOCK1, SIM_FL_UNLOCK2, SIM_FL_AUTOSEL, SIM_FL_PROGRAM,
+    SIM_FL_ERASE1, SIM_FL_ERASE2, SIM_FL_ERASE3, SIM_FL_BYPASS_PROGRAM, SIM_FL_BYPASS_EXIT,
+    SIM_FL_STATUS, SIM_FL_INTEL_PROGRAM, SIM_FL_INTEL_ERASE, SIM_FL_INTEL_LOCK,
+    SIM_FL_BUFFER_COUNT, SIM_FL_BUFFER_LOAD, SIM_FL_BUFFER_CONFIRM, SIM_FL_CFI
+};
+
+// Broadcom chipcommon serial flash controller
+#define SIM_SPI_CTL         0x18000040
+#define SIM_SPI_ADDR        0x18000044
+#define SIM_SPI_DATA        0x18000048
+#define SIM_SPI_START       0x80000000
+#define SIM_SPI_BYTE_NS     320         // 25MHz serial clock
+
+static int             sim_state;
+static unsigned int    sim_ir, sim_ir_shift;
+static uint64_t        sim_dr_lo;
+static unsigned int    sim_dr_hi;
+static int             sim_dr_len;
+static int             sim_spracc;     // SPrAcc captured by the last FASTDATA scan
+
+static unsigned int    sim_address;
+static unsigned int    sim_data;
+static unsigned int    sim_control;
+static unsigned int    sim_dcr = 0x00000004;   // memory protection on, as out of reset
+
+static sim_cpu_type    sim_cpu;
+static sim_flash_type  sim_flash;
+static unsigned char  *sim_ram[SIM_PAGES];
+
+char                  *sim_image = NULL;      // flash contents persisted across runs (/simimage:)
+uint64_t               sim_tck_cycles = 0;
+uint64_t               sim_dma_accesses = 0;
+uint64_t               sim_pracc_accesses = 0;
+uint64_t               sim_dma_latency = 0;      // TCK cycles a DMA access keeps DSTRT set (/simlatency:)
+char                  *sim_flash_name = "amd";  // flash chip to model (/simflash:)
+unsigned int           sim_tck_khz = 1000;      // virtual TCK rate the flash timings run against (/simtck:)
+static uint64_t        sim_dma_busy_until = 0;
+
+
+// ---------------------------------------
+// ---- Memory Map ----
+// ---------------------------------------
+
+static unsigned char *sim_ram_page(unsigned int phys)
+{
+    unsigned char **page = &sim_ram[(phys & 0x1FFFFFFF) >> SIM_PAGE_SHIFT];
+
+    if (*page == NULL)
+    {
+        *page = calloc(1, SIM_PAGE_SIZE);
+        if (*page == NULL)
+        {
+            printf("sim: out of memory\n");
+            exit(1);
+        }
+    }
+    return *page;
+}
+
+// Virtual time: the target sees TCK at sim_tck_khz, however fast we run
+static uint64_t sim_now(void)
+{
+    return sim_tck_cycles * 1000000 / sim_tck_khz;
+}
+
+static int sim_flash_sector(unsigned int off, unsigned int *start, unsigned int *size)
+{
+    unsigned int i, n, base = 0;
+
+    for (i = 0; i < 4; i++)
+        for (n = 0; n < sim_flash.chip->regions[i][0]; n++)
+        {
+            if ((off >= base) && (off < base + sim_flash.chip->regions[i][1]))
+            {
+                *start = base;
+                *size  = sim_flash.chip->regions[i][1];
+                return 1;
+            }
+            base += sim_flash.chip->regions[i][1];
+        }
+    return 0;
+}
+
+static void sim_flash_start(int op, uint64_t t)
+{
+    sim_flash.op         = op;
+    sim_flash.last_op    = op;
+    sim_flash.polling    = 1;
+    sim_flash.busy_until = sim_now() + t;
+}
+
+static void sim_flash_program(unsigned int off, unsigned int v)
+{
+    sim_flash.mem[off]     &= v & 0xFF;
+    sim_flash.mem[off + 1] &= (v >> 8) & 0xFF;
+    sim_flash.dq7 = v & 0x80;
+    sim_flash.programs++;
+    sim_flash.program_bytes += 2;
+    sim_flash_start(SIM_OP_PROGRAM, sim_flash.chip->t_program);
+}
+
+static void sim_flash_queue(unsigned int start, unsigned int size)
+{
+    if (sim_flash.queued < SIM_ERASE_QUEUE)
+    {
+        sim_flash.queue[sim_flash.queued][0] = start;
+        sim_flash.queue[sim_flash.queued][1] = size;
+        sim_flash.queued++;
+    }
+}
+
+// Bring the embedded operation up to the current virtual time
+static void sim_flash_update(void)
+{
+    uint64_t now = sim_now();
+    int i;
+
+    if (sim_flash.window_until && (now >= sim_flash.window_until))
+    {
+        // AMD sector erase timeout expired: the queued sectors go now
+        sim_flash.busy_until   = sim_flash.window_until + sim_flash.queued * sim_flash.chip->t_erase;
+        sim_flash.window_until = 0;
+    }
+
+    if ((sim_flash.op != SIM_OP_NONE) && !sim_flash.window_until && (now >= sim_flash.busy_until))
+    {
+        for (i = 0; i < sim_flash.queued; i++)
+            memset(sim_flash.mem + sim_flash.queue[i][0], 0xFF, sim_flash.queue[i][1]);
+        sim_flash.erases += sim_flash.queued;
+        sim_flash.queued  = 0;
+        sim_flash.op      = SIM_OP_NONE;
+        if (sim_flash.chip->kind == SIM_SPI)
+            sim_flash.status &= ~0x02;  // write enable latch drops when done
+        else
+            sim_flash.status |= 0x80;   // Intel: ready
+    }
+}
+
+static void sim_flash_poll(int busy)
+{
+    if (sim_flash.last_op == SIM_OP_ERASE) sim_flash.erase_polls++;
+    else sim_flash.program_polls++;
+    if (busy) sim_flash.busy_polls++;
+}
+
+// Program what was loaded into the AMD write buffer in one operation
+static void sim_flash_program_buffer(void)
+{
+    unsigned int i, off, v;
+
+    for (i = 0; i < sim_flash.buf_loaded; i++)
+    {
+        off = sim_flash.buf[i][0];
+        v   = sim_flash.buf[i][1];
+        sim_flash.mem[off]     &= v & 0xFF;
+        sim_flash.mem[off + 1] &= (v >> 8) & 0xFF;
+    }
+    sim_flash.programs++;
+    sim_flash.program_bytes += 2 * sim_flash.buf_loaded;
+    sim_flash_start(SIM_OP_PROGRAM, sim_flash.chip->t_buffer);
+}
+
+static void sim_flash_abort_buffer(void)
+{
+    sim_flash.aborted = 1;
+    sim_flash.state   = SIM_FL_READ;
+}
+
+// AMD/SST status while an embedded operation runs: DQ7 data# polling,
+// DQ6 toggling on every read, DQ3 once the sector erase timeout is over,
+// DQ1 after a write buffer abort
+static unsigned int sim_flash_amd_status(void)
+{
+    unsigned int st;
+
+    sim_flash.toggle ^= 0x40;
+    if ((sim_flash.op == SIM_OP_PROGRAM) || sim_flash.aborted)
+        st = (sim_flash.dq7 ^ 0x80) | sim_flash.toggle | (sim_flash.aborted ? 0x02 : 0);
+    else
+        st = sim_flash.toggle | (sim_flash.window_until ? 0 : 0x08);
+    sim_flash_poll(1);
+    return st | (st << 8);
+}
+
+static unsigned int sim_flash_read16(unsigned int off)
+{
+    unsigned int woff = off >> 1;
+
+    sim_flash_update();
+
+    switch (sim_flash.chip->kind)
+    {
+    case SIM_AMD:
+    case SIM_SST:
+        if ((sim_flash.op != SIM_OP_NONE) || sim_flash.aborted)
+            return sim_flash_amd_status();
+        if (sim_flash.polling)
+        {
+            sim_flash.polling = 0;
+            sim_flash_poll(0);
+        }
+        if (sim_flash.state == SIM_FL_AUTOSEL)
+        {
+            if (woff == 0x00) return sim_flash.chip->vendid;
+            if (woff == 0x01) return sim_flash.chip->devid;
+            if (woff == 0x0E) return (sim_flash.subid >> 8) & 0xFF;
+            if (woff == 0x0F) return sim_flash.subid & 0xFF;
+            return 0;
+        }
+        break;
+
+    case SIM_BSC:
+    case SIM_SCS:
+        if (sim_flash.state == SIM_FL_AUTOSEL)
+        {
+            if (woff == 0x00) return sim_flash.chip->vendid;
+            if (woff == 0x01) return sim_flash.chip->devid;
+            return 0;
+        }
+        if (sim_flash.state == SIM_FL_CFI)
+        {
+            // Just "QRY" and the write buffer size out of the CFI table
+            if (woff == 0x10) return 'Q';
+            if (woff == 0x11) return 'R';
+            if (woff == 0x12) return 'Y';
+            if (woff == 0x2A)
+            {
+                unsigned int n;
+                for (n = 0; (1U << n) < sim_flash.chip->write_buffer; n++);
+                return n;
+            }
+            return 0;
+        }
+        if (sim_flash.state != SIM_FL_READ)
+        {
+            sim_flash_poll(sim_flash.op != SIM_OP_NONE);
+            return sim_flash.status | (sim_flash.status << 8);
+        }
+        break;
+    }
+
+    return sim_flash.mem[off] | (sim_flash.mem[off + 1] << 8);
+}
+
+static void sim_flash_write_amd(unsigned int off, unsigned int v)
+{
+    unsigned int cmd = v & 0xFF;
+    unsigned int mask = (sim_flash.chip->kind == SIM_SST) ? 0x7FFF : 0x7FF;
+    unsigned int unlock1 = (sim_flash.chip->kind == SIM_SST) ? 0x5555 : 0x555;
+    unsigned int unlock2 = (sim_flash.chip->kind == SIM_SST) ? 0x2AAA : 0x2AA;
+    unsigned int cmdaddr = (off >> 1) & mask;
+    unsigned int start, size;
+
+    if (sim_flash.window_until)
+    {
+        // AMD: more sectors while the erase timeout is open, anything else aborts the erase
+        if ((cmd == 0x30) && sim_flash_sector(off, &start, &size))
+        {
+            sim_flash_queue(start, size);
+            sim_flash.window_until = sim_now() + SIM_ERASE_WINDOW;
+        }
+        else
+        {
+            sim_flash.window_until = 0;
+            sim_flash.queued = 0;
+            sim_flash.op     = SIM_OP_NONE;
+            sim_flash.state  = SIM_FL_READ;
+        }
+        return;
+    }
+
+    if (sim_flash.op != SIM_OP_NONE)
+        return;     // ignored while busy
+
+    if ((cmd == 0xF0) && (sim_flash.state != SIM_FL_PROGRAM) && (sim_flash.state != SIM_FL_BYPASS_PROGRAM) &&
+        (sim_flash.state != SIM_FL_BUFFER_LOAD) && !sim_flash.aborted)
+    {
+        sim_flash.state  = SIM_FL_READ;
+        sim_flash.bypass = 0;
+        return;
+    }
+
+    switch (sim_flash.state)
+    {
+    case SIM_FL_READ:
+    case SIM_FL_AUTOSEL:
+        if (sim_flash.bypass)
+        {
+            if (cmd == 0xA0) sim_flash.state = SIM_FL_BYPASS_PROGRAM;
+            if (cmd == 0x90) sim_flash.state = SIM_FL_BYPASS_EXIT;
+        }
+        else if ((cmdaddr == unlock1) && (cmd == 0xAA))
+            sim_flash.state = SIM_FL_UNLOCK1;
+        break;
+
+    case SIM_FL_UNLOCK1:
+        sim_flash.state = ((cmdaddr == unlock2) && (cmd == 0x55)) ? SIM_FL_UNLOCK2 : SIM_FL_READ;
+        break;
+
+    case SIM_FL_UNLOCK2:
+        sim_flash.state = SIM_FL_READ;
+        if ((cmd == 0x25) && sim_flash.chip->write_buffer && !sim_flash.aborted && sim_flash_sector(off, &start, &size))
+        {
+            sim_flash.buf_sector = start;
+            sim_flash.state = SIM_FL_BUFFER_COUNT;
+            break;
+        }
+        if (cmdaddr != unlock1)
+            break;
+        if (sim_flash.aborted)
+        {
+            // Only the Write-to-Buffer abort reset gets out of it
+            if (cmd == 0xF0) sim_flash.aborted = 0;
+            break;
+        }
+        if (cmd == 0x90) sim_flash.state = SIM_FL_AUTOSEL;
+        if (cmd == 0xA0) sim_flash.state = SIM_FL_PROGRAM;
+        if (cmd == 0x80) sim_flash.state = SIM_FL_ERASE1;
+        if ((cmd == 0x20) && (sim_flash.chip->kind == SIM_AMD)) sim_flash.bypass = 1;
+        break;
+
+    case SIM_FL_PROGRAM:
+    case SIM_FL_BYPASS_PROGRAM:
+        sim_flash_program(off, v);
+        sim_flash.state = SIM_FL_READ;
+        break;
+
+    case SIM_FL_BUFFER_COUNT:
+        // Halfword count less one, to the same sector, and no more than fits
+        sim_flash.buf_count  = (v & 0xFF) + 1;
+        sim_flash.buf_loaded = 0;
+        sim_flash.dq7 = 0;
+        if (!sim_flash_sector(off, &start, &size) || (start != sim_flash.buf_sector) ||
+            (sim_flash.buf_count * 2 > sim_flash.chip->write_buffer))
+            sim_flash_abort_buffer();
+        else
+            sim_flash.state = SIM_FL_BUFFER_LOAD;
+        break;
+
+    case SIM_FL_BUFFER_LOAD:
+        // Every halfword within the write buffer page of the first one
+        if (sim_flash.buf_loaded &&
+            ((off / sim_flash.chip->write_buffer) != (sim_flash.buf[0][0] / sim_flash.chip->write_buffer)))
+        {
+            sim_flash_abort_buffer();
+            break;
+        }
+        sim_flash.buf[sim_flash.buf_loaded][0] = off;
+        sim_flash.buf[sim_flash.buf_loaded][1] = v;
+        sim_flash.buf_loaded++;
+        sim_flash.dq7 = v & 0x80;
+        if (sim_flash.buf_loaded == sim_flash.buf_count)
+            sim_flash.state = SIM_FL_BUFFER_CONFIRM;
+        break;
+
+    case SIM_FL_BUFFER_CONFIRM:
+        sim_flash.state = SIM_FL_READ;
+        if ((cmd == 0x29) && sim_flash_sector(off, &start, &size) && (start == sim_flash.buf_sector))
+            sim_flash_program_buffer();
+        else
+            sim_flash_abort_buffer();
+        break;
+
+    case SIM_FL_BYPASS_EXIT:
+        if (cmd == 0x00) sim_flash.bypass = 0;
+        sim_flash.state = SIM_FL_READ;
+        break;
+
+    case SIM_FL_ERASE1:
+        sim_flash.state = ((cmdaddr == unlock1) && (cmd == 0xAA)) ? SIM_FL_ERASE2 : SIM_FL_READ;
+        break;
+
+    case SIM_FL_ERASE2:
+        sim_flash.state = ((cmdaddr == unlock2) && (cmd == 0x55)) ? SIM_FL_ERASE3 : SIM_FL_READ;
+        break;
+
+    case SIM_FL_ERASE3:
+        sim_flash.state = SIM_FL_READ;
+        if ((cmd == 0x10) && (cmdaddr == unlock1))
+        {
+            sim_flash_queue(0, sim_flash.size);
+            sim_flash_start(SIM_OP_ERASE, sim_flash.chip->t_chip);
+        }
+        else if (sim_flash.chip->kind == SIM_SST)
+        {
+            // 0x30 erases a 4KB sector, 0x50 a 64KB block
+            if (cmd == 0x30) sim_flash_queue(off & ~0xFFF, 0x1000);
+            if (cmd == 0x50) sim_flash_queue(off & ~0xFFFF, 0x10000);
+            if (sim_flash.queued) sim_flash_start(SIM_OP_ERASE, sim_flash.chip->t_erase);
+        }
+        else if ((cmd == 0x30) && sim_flash_sector(off, &start, &size))
+        {
+            sim_flash_queue(start, size);
+            sim_flash.op = SIM_OP_ERASE;
+            sim_flash.last_op = SIM_OP_ERASE;
+            sim_flash.polling = 1;
+            sim_flash.window_until = sim_now() + SIM_ERASE_WINDOW;
+        }
+        break;
+    }
+}
+
+static void sim_flash_write_intel(unsigned int off, unsigned int v)
+{
+    unsigned int cmd = v & 0xFF;
+    unsigned int start, size;
+
+    if (sim_flash.op != SIM_OP_NONE)
+    {
+        if (cmd == 0x70) sim_flash.state = SIM_FL_STATUS;
+        return;     // everything else is ignored while busy
+    }
+
+    switch (sim_flash.state)
+    {
+    case SIM_FL_INTEL_PROGRAM:
+        sim_flash_program(off, v);
+        sim_flash.status = 0;
+        sim_flash.state  = SIM_FL_STATUS;
+        return;
+
+    case SIM_FL_INTEL_ERASE:
+        sim_flash.state = SIM_FL_STATUS;
+        if ((cmd == 0xD0) && sim_flash_sector(off, &start, &size))
+        {
+            sim_flash_queue(start, size);
+            sim_flash.status = 0;
+            sim_flash_start(SIM_OP_ERASE, sim_flash.chip->t_erase);
+        }
+        else
+            sim_flash.status |= 0x30;   // command sequence error
+        return;
+
+    case SIM_FL_INTEL_LOCK:
+        sim_flash.state = SIM_FL_STATUS;
+        if ((cmd == 0xD0) && sim_flash.chip->t_unlock)
+        {
+            // J3 clears all the lock-bits at once and takes its time over it
+            sim_flash.status = 0;
+            sim_flash_start(SIM_OP_ERASE, sim_flash.chip->t_unlock);
+        }
+        return;
+
+    case SIM_FL_BUFFER_COUNT:
+        // Word count less one, no more than fits in the buffer
+        sim_flash.buf_count  = (v & 0xFF) + 1;
+        sim_flash.buf_loaded = 0;
+        if (sim_flash.buf_count * 2 > sim_flash.chip->write_buffer)
+        {
+            sim_flash.status |= 0x30;   // command sequence error
+            sim_flash.state   = SIM_FL_STATUS;
+        }
+        else
+            sim_flash.state = SIM_FL_BUFFER_LOAD;
+        return;
+
+    case SIM_FL_BUFFER_LOAD:
+        // Every word within the write buffer page of the first one
+        if (sim_flash.buf_loaded &&
+            ((off / sim_flash.chip->write_buffer) != (sim_flash.buf[0][0] / sim_flash.chip->write_buffer)))
+        {
+            sim_flash.status |= 0x30;
+            sim_flash.state   = SIM_FL_STATUS;
+            return;
+        }
+        sim_flash.buf[sim_flash.buf_loaded][0] = off;
+        sim_flash.buf[sim_flash.buf_loaded][1] = v;
+        sim_flash.buf_loaded++;
+        if (sim_flash.buf_loaded == sim_flash.buf_count)
+            sim_flash.state = SIM_FL_BUFFER_CONFIRM;
+        return;
+
+    case SIM_FL_BUFFER_CONFIRM:
+        sim_flash.state = SIM_FL_STATUS;
+        if ((cmd == 0xD0) && sim_flash_sector(off, &start, &size) && (start == sim_flash.buf_sector))
+        {
+            sim_flash.status &= ~0x80;
+            sim_flash_program_buffer();
+        }
+        else
+            sim_flash.status |= 0x30;
+        return;
+    }
+
+    switch (cmd)
+    {
+    case 0xFF: sim_flash.state = SIM_FL_READ;                       break;
+    case 0x90: sim_flash.state = SIM_FL_AUTOSEL;                    break;
+    case 0x70: sim_flash.state = SIM_FL_STATUS;                     break;
+    case 0x50: sim_flash.status = 0x80;                             break;
+    case 0x10:
+    case 0x40: sim_flash.state = SIM_FL_INTEL_PROGRAM;              break;
+    case 0x20: sim_flash.state = SIM_FL_INTEL_ERASE;                break;
+    case 0x60: sim_flash.state = SIM_FL_INTEL_LOCK;                 break;
+    case 0x98: sim_flash.state = SIM_FL_CFI;                        break;
+    case 0xE8:
+        // XSR.7 reads back set: the buffer is free whenever the chip is idle
+        if (sim_flash.chip->write_buffer && sim_flash_sector(off, &start, &size))
+        {
+            sim_flash.buf_sector = start;
+            sim_flash.state      = SIM_FL_BUFFER_COUNT;
+        }
+        break;
+    }
+}
+
+static void sim_flash_write16(unsigned int off, unsigned int v)
+{
+    sim_flash_update();
+
+    switch (sim_flash.chip->kind)
+    {
+    case SIM_AMD:
+    case SIM_SST:
+        sim_flash_write_amd(off, v);
+        break;
+    case SIM_BSC:
+    case SIM_SCS:
+        sim_flash_write_intel(off, v);
+        break;
+    }
+}
+
+// One command through the Broadcom serial flash controller
+static void sim_spi_command(unsigned int ctl)
+{
+    unsigned int op = ctl & 0xFF;
+    unsigned int off = sim_flash.spi_addr & (sim_flash.size - 1);
+    unsigned int start, size, n = ((ctl & 0x700) == 0x400) ? 4 : 1;
+    int busy;
+
+    sim_flash_update();
+    busy = (sim_flash.op != SIM_OP_NONE);
+
+    switch (op)
+    {
+    case 0x06:  if (!busy) sim_flash.status |= 0x02;        break;   // write enable
+    case 0x04:  if (!busy) sim_flash.status &= ~0x02;       break;   // write disable
+    case 0x05:                                                       // read status
+        sim_flash.spi_data = sim_flash.status | busy;
+        sim_flash_poll(busy);
+        break;
+    case 0x9F:                                                       // read id
+        sim_flash.spi_data = ((sim_flash.chip->devid & 0xFF) << 16) | (sim_flash.chip->devid & 0xFF00) | sim_flash.chip->vendid;
+        break;
+    case 0x03:                                                       // read data
+        sim_flash.spi_data = sim_flash.mem[off] | (sim_flash.mem[off + 1] << 8) |
+                             (sim_flash.mem[off + 2] << 16) | ((unsigned int)sim_flash.mem[off + 3] << 24);
+        break;
+    case 0x02:                                                       // page program
+        if (busy || !(sim_flash.status & 0x02))
+            break;
+        for (start = 0; start < n; start++)
+            sim_flash.mem[(off + start) & (sim_flash.size - 1)] &= sim_flash.spi_data >> (8 * start);
+        sim_flash.programs++;
+        sim_flash.program_bytes += n;
+        sim_flash_start(SIM_OP_PROGRAM, sim_flash.chip->t_program + n * sim_flash.chip->t_byte);
+        break;
+    case 0xD8:                                                       // sector erase
+        if (busy || !(sim_flash.status & 0x02) || !sim_flash_sector(off, &start, &size))
+            break;
+        sim_flash_queue(start, size);
+        sim_flash_start(SIM_OP_ERASE, sim_flash.chip->t_erase);
+        break;
+    case 0xC7:                                                       // bulk erase
+        if (busy || !(sim_flash.status & 0x02))
+            break;
+        sim_flash_queue(0, sim_flash.size);
+        sim_flash_start(SIM_OP_ERASE, sim_flash.chip->t_chip);
+        break;
+    }
+
+    sim_flash.spi_busy_until = sim_now() + (1 + 3 + n) * SIM_SPI_BYTE_NS;
+}
+
+static int sim_spi_reg(unsigned int phys)
+{
+    return (sim_flash.chip->kind == SIM_SPI) && (phys >= SIM_SPI_CTL) && (phys <= SIM_SPI_DATA);
+}
+
+static unsigned int sim_spi_read(unsigned int phys)
+{
+    if (phys == SIM_SPI_ADDR) return sim_flash.spi_addr;
+    if (phys == SIM_SPI_DATA) return sim_flash.spi_data;
+    return sim_flash.spi_ctl | ((sim_now() < sim_flash.spi_busy_until) ? SIM_SPI_START : 0);
+}
+
+static void sim_spi_write(unsigned int phys, unsigned int val)
+{
+    if (phys == SIM_SPI_ADDR) sim_flash.spi_addr = val;
+    if (phys == SIM_SPI_DATA) sim_flash.spi_data = val;
+    if (phys != SIM_SPI_CTL) return;
+
+    if (sim_now() < sim_flash.spi_busy_until)
+        return;
+    sim_flash.spi_ctl = val & ~SIM_SPI_START;
+    if (val & SIM_SPI_START)
+        sim_spi_command(val);
+}
+
+// Physical bus access, value right aligned
+static unsigned int sim_bus_read(unsigned int phys, int size)
+{
+    unsigned char *page;
+    unsigned int off, val;
+
+    if (sim_spi_reg(phys))
+        return sim_spi_read(phys & ~3);
+
+    if ((sim_flash.chip->kind == SIM_SPI) && (phys >= sim_flash.base) && (phys - sim_flash.base < sim_flash.size))
+    {
+        off = phys - sim_flash.base;
+        val = sim_flash.mem[off & ~3] | (sim_flash.mem[(off & ~3) + 1] << 8) |
+              (sim_flash.mem[(off & ~3) + 2] << 16) | ((unsigned int)sim_flash.mem[(off & ~3) + 3] << 24);
+        if (size == 1) return (val >> (8 * (off & 3))) & 0xFF;
+        if (size == 2) return (val >> (8 * (off & 2))) & 0xFFFF;
+        return val;
+    }
+
+    if ((phys >= sim_flash.base) && (phys - sim_flash.base < sim_flash.size))
+    {
+        off = (phys - sim_flash.base) & ~1;
+        if (size == 4)
+            return sim_flash_read16(off) | (sim_flash_read16(off + 2) << 16);
+        val = sim_flash_read16(off);
+        if (size == 1)
+            val = (phys & 1) ? (val >> 8) : (val & 0xFF);
+        return val;
+    }
+
+    page = sim_ram_page(phys);
+    off  = phys & (SIM_PAGE_SIZE - 1);
+    if (size == 1) return page[off];
+    if (size == 2) return page[off & ~1] | (page[(off & ~1) + 1] << 8);
+    off &= ~3;
+    return page[off] | (page[off + 1] << 8) | (page[off + 2] << 16) | ((unsigned int)page[off + 3] << 24);
+}
+
+static void sim_bus_write(unsigned int phys, int size, unsigned int val)
+{
+    unsigned char *page;
+    unsigned int off;
+
+    if (sim_spi_reg(phys))
+    {
+        sim_spi_write(phys & ~3, val);
+        return;
+    }
+
+    if ((sim_flash.chip->kind == SIM_SPI) && (phys >= sim_flash.base) && (phys - sim_flash.base < sim_flash.size))
+        return;     // serial flash is read only through the window
+
+    if ((phys >= sim_flash.base) && (phys - sim_flash.base < sim_flash.size))
+    {
+        off = (phys - sim_flash.base) & ~1;
+        if (size == 4)
+        {
+            sim_flash_write16(off, val & 0xFFFF);
+            sim_flash_write16(off + 2, val >> 16);
+        }
+        else
+            sim_flash_write16(off, val & 0xFFFF);
+        return;
+    }
+
+    page = sim_ram_page(phys);
+    off  = phys & (SIM_PAGE_SIZE - 1);
+    if (size == 1)
+        page[off] = val;
+    else if (size == 2)
+    {
+        off &= ~1;
+        page[off] = val;
+        page[off + 1] = val >> 8;
+    }
+    else
+    {
+        off &= ~3;
+        page[off] = val;
+        page[off + 1] = val >> 8;
+        page[off + 2] = val >> 16;
+        page[off + 3] = val >> 24;
+    }
+}
+
+static unsigned int sim_phys(unsigned int addr)
+{
+    if ((addr >= 0x80000000) && (addr < 0xC0000000))
+        return addr & 0x1FFFFFFF;
+    return addr;
+}
+
+static unsigned int sim_drseg_read(unsigned int addr)
+{
+    if (addr == SIM_DRSEG_START) return sim_dcr;
+    return 0;
+}
+
+static void sim_drseg_write(unsigned int addr, unsigned int val)
+{
+    if (addr == SIM_DRSEG_START) sim_dcr = val;
+}
+
+
+// ---------------------------------------
+// ---- Debug Mode Processor ----
+// ---------------------------------------
+
+static void sim_cpu_run(void);
+
+static int sim_is_dmseg(unsigned int addr)
+{
+    return (addr >= SIM_DMSEG_START) && (addr <= SIM_DMSEG_END);
+}
+
+static unsigned int sim_load_extend(unsigned int val, int size, int sign)
+{
+    if (sign && (size == 1)) return (unsigned int)(int)(signed char)val;
+    if (sign && (size == 2)) return (unsigned int)(int)(short)val;
+    return val;
+}
+
+static void sim_cpu_access(int kind, unsigned int addr, int size, int sign, int rt)
+{
+    unsigned int val;
+
+    if (sim_is_dmseg(addr))
+    {
+        // Processor access to the probe: park it until the probe services it
+        sim_cpu.pend        = kind;
+        sim_cpu.pend_addr   = addr;
+        sim_cpu.pend_size   = size;
+        sim_cpu.pend_signed = sign;
+        sim_cpu.pend_rt     = rt;
+        sim_address = addr;
+        if (kind == SIM_STORE)
+            sim_data = sim_cpu.r[rt];
+        return;
+    }
+
+    if ((addr >= SIM_DRSEG_START) && (addr <= SIM_DRSEG_END))
+    {
+        if (kind == SIM_STORE) sim_drseg_write(addr, sim_cpu.r[rt]);
+        else if (rt) sim_cpu.r[rt] = sim_drseg_read(addr);
+        return;
+    }
+
+    if (kind == SIM_STORE)
+        sim_bus_write(sim_phys(addr), size, sim_cpu.r[rt]);
+    else
+    {
+        val = sim_load_extend(sim_bus_read(sim_phys(addr), size), size, sign);
+        if (rt) sim_cpu.r[rt] = val;
+    }
+}
+
+static void sim_cpu_exec(unsigned int insn)
+{
+    unsigned int op = insn >> 26;
+    unsigned int rs = (insn >> 21) & 0x1F;
+    unsigned int rt = (insn >> 16) & 0x1F;
+    unsigned int rd = (insn >> 11) & 0x1F;
+    unsigned int imm = insn & 0xFFFF;
+    unsigned int simm = (unsigned int)(int)(short)imm;
+    unsigned int pc = sim_cpu.pc;
+    unsigned int *r = sim_cpu.r;
+
+    sim_cpu.pc   = sim_cpu.npc;
+    sim_cpu.npc += 4;
+
+    switch (op)
+    {
+    case 0x00:   // SPECIAL
+        switch (insn & 0x3F)
+        {
+        case 0x00: r[rd] = r[rt] << ((insn >> 6) & 0x1F);  break;   // sll / nop
+        case 0x08: sim_cpu.npc = r[rs];                    break;   // jr
+        case 0x21: r[rd] = r[rs] + r[rt];                  break;   // addu
+        case 0x25: r[rd] = r[rs] | r[rt];                  break;   // or
+        }
+        break;
+    case 0x04: if (r[rs] == r[rt]) sim_cpu.npc = pc + 4 + (simm << 2);  break;   // beq
+    case 0x05: if (r[rs] != r[rt]) sim_cpu.npc = pc + 4 + (simm << 2);  break;   // bne
+    case 0x09: r[rt] = r[rs] + simm;                                    break;   // addiu
+    case 0x0D: r[rt] = r[rs] | imm;                                     break;   // ori
+    case 0x0F: r[rt] = imm << 16;                                       break;   // lui
+    case 0x10:   // COP0
+        if (insn == 0x4200001F)
+        {
+            // deret: leave debug mode, the processor runs off on its own
+            sim_cpu.debug = 0;
+            sim_cpu.pc = sim_cpu.npc = sim_cpu.depc;
+        }
+        else if ((rs == 0x00) && (rd == 24)) r[rt] = sim_cpu.depc;     // mfc0 DEPC
+        else if ((rs == 0x04) && (rd == 24)) sim_cpu.depc = r[rt];     // mtc0 DEPC
+        break;
+    case 0x20: sim_cpu_access(SIM_LOAD, r[rs] + simm, 1, 1, rt);   break;   // lb
+    case 0x21: sim_cpu_access(SIM_LOAD, r[rs] + simm, 2, 1, rt);   break;   // lh
+    case 0x23: sim_cpu_access(SIM_LOAD, r[rs] + simm, 4, 0, rt);   break;   // lw
+    case 0x24: sim_cpu_access(SIM_LOAD, r[rs] + simm, 1, 0, rt);   break;   // lbu
+    case 0x25: sim_cpu_access(SIM_LOAD, r[rs] + simm, 2, 0, rt);   break;   // lhu
+    case 0x28: sim_cpu_access(SIM_STORE, r[rs] + simm, 1, 0, rt);  break;   // sb
+    case 0x29: sim_cpu_access(SIM_STORE, r[rs] + simm, 2, 0, rt);  break;   // sh
+    case 0x2B: sim_cpu_access(SIM_STORE, r[rs] + simm, 4, 0, rt);  break;   // sw
+    }
+    r[0] = 0;
+}
+
+// Run until the processor needs the probe (or leaves debug mode)
+static void sim_cpu_run(void)
+{
+    int steps = 1000000;
+
+    while (sim_cpu.debug && (sim_cpu.pend == SIM_NONE) && steps--)
+    {
+        if (sim_is_dmseg(sim_cpu.pc))
+        {
+            sim_cpu.pend      = SIM_FETCH;
+            sim_cpu.pend_addr = sim_cpu.pc;
+            sim_address       = sim_cpu.pc;
+            return;
+        }
+        sim_cpu_exec(sim_bus_read(sim_phys(sim_cpu.pc), 4));
+    }
+}
+
+// The probe has serviced the pending access, sim_data holds its reply
+static void sim_cpu_complete(void)
+{
+    int kind = sim_cpu.pend;
+
+    sim_cpu.pend = SIM_NONE;
+    sim_pracc_accesses++;
+
+    if (kind == SIM_FETCH)
+        sim_cpu_exec(sim_data);
+    else if ((kind == SIM_LOAD) && sim_cpu.pend_rt)
+        sim_cpu.r[sim_cpu.pend_rt] = sim_load_extend(sim_data, sim_cpu.pend_size, sim_cpu.pend_signed);
+
+    sim_cpu_run();
+}
+
+static void sim_cpu_break(void)
+{
+    if (sim_cpu.debug)
+        return;
+    sim_cpu.debug = 1;
+    sim_cpu.pend  = SIM_NONE;
+    sim_cpu.pc    = 0xFF200200;
+    sim_cpu.npc   = sim_cpu.pc + 4;
+    sim_cpu_run();
+}
+
+
+// ---------------------------------------
+// ---- EJTAG Registers ----
+// ---------------------------------------
+
+static unsigned int sim_control_read(void)
+{
+    unsigned int ctrl = sim_control & (PROBEN | PROBTRAP | DMAACC | DRWN | DMA_TRIPLEBYTE);
+
+    if (sim_cpu.pend != SIM_NONE) ctrl |= PRACC;
+    if (sim_cpu.pend == SIM_STORE) ctrl |= PRNW;
+    if (sim_cpu.debug) ctrl |= BRKST;
+    if (sim_tck_cycles < sim_dma_busy_until) ctrl |= DSTRT;
+    return ctrl;
+}
+
+static void sim_dma(unsigned int ctrl)
+{
+    unsigned int size = (ctrl & DMA_TRIPLEBYTE) >> 7;
+    unsigned int addr = sim_address;
+    unsigned int lane = (addr & 3) * 8;
+    unsigned int val;
+
+    sim_dma_accesses++;
+    size = (size == 0) ? 1 : (size == 1) ? 2 : 4;
+
+    if ((addr >= SIM_DRSEG_START) && (addr <= SIM_DRSEG_END))
+    {
+        if (ctrl & DRWN) sim_data = sim_drseg_read(addr);
+        else sim_drseg_write(addr, sim_data);
+        return;
+    }
+
+    // DMA data travels on its byte lanes
+    if (size == 4) lane = 0;
+    if (size == 2) lane &= 16;
+
+    if (ctrl & DRWN)
+    {
+        val = sim_bus_read(sim_phys(addr), size);
+        sim_data = (size == 4) ? val : (val << lane);
+    }
+    else
+    {
+        val = (size == 4) ? sim_data : (sim_data >> lane);
+        sim_bus_write(sim_phys(addr), size, val);
+    }
+}
+
+static void sim_control_write(unsigned int ctrl)
+{
+    sim_control = ctrl;
+
+    if (ctrl & PRRST)
+    {
+        sim_cpu.debug = 0;
+        sim_cpu.pend  = SIM_NONE;
+        sim_flash.state  = SIM_FL_READ;
+        sim_flash.bypass = 0;
+        return;
+    }
+
+    if ((ctrl & DMAACC) && (ctrl & DSTRT) && (sim_tck_cycles >= sim_dma_busy_until))
+    {
+        // a request made while the last one is still running is dropped
+        sim_dma(ctrl);
+        sim_dma_busy_until = sim_tck_cycles + sim_dma_latency;
+    }
+
+    if (ctrl & JTAGBRK)
+        sim_cpu_break();
+    else if ((sim_cpu.pend != SIM_NONE) && !(ctrl & PRACC))
+        sim_cpu_complete();
+}
+
+static int sim_in_fastdata(void)
+{
+    return (sim_cpu.pend == SIM_LOAD || sim_cpu.pend == SIM_STORE) &&
+           (sim_cpu.pend_addr >= SIM_DMSEG_START) && (sim_cpu.pend_addr <= SIM_FASTDATA_END);
+}
+
+// A pending processor access shows its address whatever the probe last
+// wrote there for DMA
+static unsigned int sim_pend_address(void)
+{
+    return (sim_cpu.pend != SIM_NONE) ? sim_cpu.pend_addr : sim_address;
+}
+
+static void sim_capture_dr(void)
+{
+    sim_dr_hi = 0;
+    switch (sim_ir)
+    {
+    case INSTR_IDCODE:   sim_dr_lo = SIM_IDCODE;           sim_dr_len = 32;  break;
+    case INSTR_IMPCODE:  sim_dr_lo = SIM_IMPCODE;          sim_dr_len = 32;  break;
+    case INSTR_ADDRESS:  sim_dr_lo = sim_pend_address();   sim_dr_len = 32;  break;
+    case INSTR_DATA:     sim_dr_lo = sim_data;             sim_dr_len = 32;  break;
+    case INSTR_CONTROL:  sim_dr_lo = sim_control_read();   sim_dr_len = 32;  break;
+    case INSTR_ALL:
+        sim_dr_lo  = sim_control_read() | ((uint64_t)sim_data << 32);
+        sim_dr_hi  = sim_pend_address();
+        sim_dr_len = 96;
+        break;
+    case INSTR_FASTDATA:
+        sim_spracc = sim_in_fastdata();
+        sim_dr_lo  = sim_spracc | ((uint64_t)sim_data << 1);
+        sim_dr_len = 33;
+        break;
+    default:
+        sim_dr_lo  = 0;
+        sim_dr_len = 1;
+    }
+}
+
+static void sim_update_dr(void)
+{
+    switch (sim_ir)
+    {
+    case INSTR_ADDRESS:  sim_address = (unsigned int)sim_dr_lo;   break;
+    case INSTR_DATA:     sim_data = (unsigned int)sim_dr_lo;      break;
+    case INSTR_CONTROL:  sim_control_write((unsigned int)sim_dr_lo);  break;
+    case INSTR_ALL:
+        sim_address = sim_dr_hi;
+        sim_data    = (unsigned int)(sim_dr_lo >> 32);
+        sim_control_write((unsigned int)sim_dr_lo);
+        break;
+    case INSTR_FASTDATA:
+        sim_data = (unsigned int)(sim_dr_lo >> 1);
+        if (sim_spracc && !(sim_dr_lo & 1) && sim_in_fastdata())
+            sim_cpu_complete();
+        break;
+    }
+}
+
+static void sim_shift_dr(int tdi)
+{
+    if (sim_dr_len <= 64)
+    {
+        sim_dr_lo >>= 1;
+        if (tdi) sim_dr_lo |= (uint64_t)1 << (sim_dr_len - 1);
+    }
+    else
+    {
+        sim_dr_lo = (sim_dr_lo >> 1) | ((uint64_t)(sim_dr_hi & 1) << 63);
+        sim_dr_hi >>= 1;
+        if (tdi) sim_dr_hi |= 1u << (sim_dr_len - 65);
+    }
+}
+
+// One TCK cycle: returns TDO as seen on the rising edge
+static int sim_clock(int tms, int tdi)
+{
+    int tdo = 0;
+
+    sim_tck_cycles++;
+
+    switch (sim_state)
+    {
+    case SIM_CAPDR:
+        sim_capture_dr();
+        break;
+    case SIM_SHIFTDR:
+        tdo = (int)(sim_dr_lo & 1);
+        sim_shift_dr(tdi);
+        break;
+    case SIM_CAPIR:
+        sim_ir_shift = 0x01;
+        break;
+    case SIM_SHIFTIR:
+        tdo = sim_ir_shift & 1;
+        sim_ir_shift = (sim_ir_shift >> 1) | ((tdi ? 1 : 0) << (SIM_IRLEN - 1));
+        break;
+    }
+
+    sim_state = sim_tap_next[sim_state][tms ? 1 : 0];
+
+    if (sim_state == SIM_UPDDR)  sim_update_dr();
+    if (sim_state == SIM_UPDIR)  sim_ir = sim_ir_shift;
+    if (sim_state == SIM_TLR)    sim_ir = INSTR_IDCODE;
+
+    return tdo;
+}
+
+static void sim_open(void)
+{
+    sim_chip_type *chip;
+    unsigned int i;
+
+    for (i = 0; i < SIM_PAGES; i++)
+    {
+        free(sim_ram[i]);
+        sim_ram[i] = NULL;
+    }
+    memset(&sim_cpu, 0, sizeof(sim_cpu));
+    sim_state   = SIM_TLR;
+    sim_ir      = INSTR_IDCODE;
+    sim_control = 0;
+    sim_address = sim_data = 0;
+    sim_tck_cycles = sim_dma_accesses = sim_pracc_accesses = 0;
+    sim_dma_busy_until = 0;
+
+    free(sim_flash.mem);
+    memset(&sim_flash, 0, sizeof(sim_flash));
+    for (chip = sim_chip_list; chip->name; chip++)
+        if (strcasecmp(chip->name, sim_flash_name) == 0) break;
+    if (!chip->name)
+    {
+        printf("sim: unknown flash '%s' (amd, sst, bsc, scs, spi, s29gl or eon)\n", sim_flash_name);
+        exit(1);
+    }
+
+    if (!sim_tck_khz) sim_tck_khz = 1000;
+
+    // The flash sits behind the usual window
+    sim_flash.chip   = chip;
+    sim_flash.base   = 0x1FC00000;
+    sim_flash.size   = chip->size;
+    sim_flash.subid  = chip->subid;
+    sim_flash.status = 0x80;
+    sim_flash.mem = malloc(sim_flash.size);
+    if (sim_flash.mem == NULL)
+    {
+        printf("sim: out of memory\n");
+        exit(1);
+    }
+    memset(sim_flash.mem, 0xFF, sim_flash.size);
+
+    if (sim_image)
+    {
+        FILE *fd = fopen(sim_image, "rb");
+        if (fd)
+        {
+            if (fread(sim_flash.mem, 1, sim_flash.size, fd) != sim_flash.size)
+                printf("sim: %s is shorter than the flash, rest left erased\n", sim_image);
+            fclose(fd);
+        }
+    }
+}
+
+static void sim_close(void)
+{
+    FILE *fd;
+
+    if (sim_image && (fd = fopen(sim_image, "wb")))
+    {
+        fwrite(sim_flash.mem, 1, sim_flash.size, fd);
+        fclose(fd);
+    }
+    printf("Simulated target: %" PRIu64 " TCK cycles, %" PRIu64 " DMA accesses, %" PRIu64 " PrAcc accesses\n",
+           sim_tck_cycles, sim_dma_accesses, sim_pracc_accesses);
+    printf("Simulated flash: %s, %.3f s at %u kHz TCK\n", sim_flash.chip->name, sim_now() / 1e9, sim_tck_khz);
+    printf("    %" PRIu64 " programs (%" PRIu64 " bytes), %" PRIu64 " status reads, %.2f per word programmed\n",
+           sim_flash.programs, sim_flash.program_bytes, sim_flash.program_polls,
+           sim_flash.program_bytes ? 4.0 * sim_flash.program_polls / sim_flash.program_bytes : 0.0);
+    printf("    %" PRIu64 " erases, %" PRIu64 " status reads, %" PRIu64 " of all status reads found it busy\n",
+           sim_flash.erases, sim_flash.erase_polls, sim_flash.busy_polls);
+}
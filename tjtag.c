@@ -26,6 +26,10 @@
 //#define WINDOWS_VERSION   // uncomment only this for Windows Compile / MS Visual C Compiler
 //#define __FreeBSD__       // uncomment only this for FreeBSD
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE       // sched_setaffinity() for /realtime
+#endif
+
 #ifdef WINDOWS_VERSION
 #include <windows.h>      // Only for Windows Compile
 #define strcasecmp  stricmp
@@ -55,6 +59,9 @@
 
 #include "tjtag.h"
 #include "spi.h"
+#ifdef SIM
+#include "sim.h"
+#endif
 
 #define TRUE  1
 #define FALSE 0
@@ -72,6 +79,18 @@
    #define GPIO_GET *(gpio+0xd) // get bits
 #endif
 
+#ifdef SIM_GPIO
+   // make bench runs the Pi kernel against memory standing in for the GPIO
+   // block and counts the SET/CLR writes it issues
+   unsigned gpio_regs[0x10];
+   volatile unsigned *gpio = gpio_regs;
+   unsigned long gpio_writes;
+
+   #define GPIO_SET *(gpio_writes++, gpio+7)
+   #define GPIO_CLR *(gpio_writes++, gpio+10)
+   #define GPIO_GET *(gpio+0xd)
+#endif
+
 static unsigned int ctrl_reg;
 volatile unsigned int dcounter;
 
@@ -84,14 +103,29 @@ int issue_break      = 1;
 int issue_erase      = 1;
 int issue_timestamp  = 1;
 int issue_reboot     = 0;
+int issue_verify     = 0;
+int run_failed       = 0;   // the requested operation went wrong, exit status 1
+int failed_words     = 0;   // words the chip reported failing to program
 int force_dma        = 0;
 int force_nodma      = 0;
+int force_noall      = 0;
+int force_nobuffer   = 0;
+int force_nobypass   = 0;
+int force_nochiperase = 0;
+int force_fastdata   = 0;
+int force_ioport     = 0;
+int portio           = 0;
+int realtime         = 0;
+int realtime_cpu     = -1;
 int selected_fc      = 0;
 unsigned int selected_window  = 0;
 unsigned int selected_start   = 0;
 unsigned int selected_length  = 0;
+unsigned int workarea         = 0xA0000800;
 int custom_options   = 0;
 int silent_mode      = 0;
+int hexdump          = 0;
+unsigned int progress_hz = 4;
 int skipdetect       = 0;
 int instrlen         = 0;
 int wiggler          = 0;
@@ -107,7 +141,12 @@ unsigned int    block_addr     = 0;
 unsigned int    cmd_type       = 0;
 int             ejtag_version  = 0;
 int             bypass         = 0;
+unsigned int    write_buffer   = 0;
+unsigned int    flash_flags    = 0;
+int             bypass_mode    = 0;
 int             USE_DMA        = 0;
+int             USE_ALL        = 0;
+int             USE_FASTDATA   = 0;
 
 
 char            flash_part[128];
@@ -122,9 +161,36 @@ unsigned int    devid;
 
 unsigned int    data_register;
 unsigned int    address_register;
+unsigned int    count_register;
+unsigned int   *block_buffer = NULL;    // data_register for the block modules, one word per access
+unsigned int    block_index;
 unsigned int    proc_id;
 unsigned int    xbit = 0;
 unsigned int    delay = 0;
+unsigned int    tck_khz = 0;
+int             auto_speed     = 0;
+int             speed_rung     = -1;     // autospeed ladder position, -1 = not tuned
+unsigned int    dma_retries    = 0;
+struct jtag_cost cost[PHASES];          // what each phase cost on the wire, see cost_report()
+int             cost_phase     = PHASE_DETECT;
+unsigned long long cost_mark   = 0;
+FILE           *trace_file     = NULL;   // /trace, every shift goes here
+FILE           *vcd_file       = NULL;   // /vcd, every edge goes here
+unsigned long long vcd_start   = 0;
+unsigned long long vcd_time    = 0;
+unsigned int    vcd_lines      = 0;
+#ifndef WINDOWS_VERSION
+int             vcd_running    = 0;      // the /vcd writer thread is up
+pthread_t       vcd_thread;
+#endif
+char           *trace_name     = NULL;
+char           *vcd_name       = NULL;
+char           *report_name    = NULL;   // /report, the JSON timing report
+struct report_step *report_steps = NULL;
+int             report_count   = 0;
+int             report_alloc   = 0;
+unsigned long long report_start = 0;
+unsigned long long trace_mark  = 0;
 unsigned int    bcmproc = 0;
 unsigned int    swap_endian=0;
 unsigned int    bigendian=0;
@@ -309,6 +375,8 @@ typedef struct _flash_chip_type
     unsigned int        region3_size;   // Region 3 block size
     unsigned int        region4_num;    // Region 4 block count
     unsigned int        region4_size;   // Region 4 block size
+    unsigned int        write_buffer;   // Write-to-Buffer size in bytes (0 if none)
+    unsigned int        flags;          // FLASH_F_...
 } flash_chip_type;
 
 
@@ -318,16 +386,16 @@ flash_chip_type  flash_chip_list[] =
     { 0x00C2, 0x22DA, size1MB, CMD_TYPE_AMD, "MX29LV800BTC 512kx16 TopB  (1MB)"   ,15,size32K,    1,size16K,    2,size4K,   1,size8K  },
     { 0x00C2, 0x225B, size1MB, CMD_TYPE_AMD, "MX29LV800BTC 512kx16 BotB  (1MB)"   ,1,size8K,      2,size4K,     1,size16K,  15,size32K },
 
-    { 0x0001, 0x2249, size2MB, CMD_TYPE_AMD, "AMD 29lv160DB 1Mx16 BotB   (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K }, /* bypass */
+    { 0x0001, 0x2249, size2MB, CMD_TYPE_AMD, "AMD 29lv160DB 1Mx16 BotB   (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K, 0, FLASH_F_BYPASS }, /* bypass */
     { 0x0001, 0x22c4, size2MB, CMD_TYPE_AMD, "AMD 29lv160DT 1Mx16 TopB   (2MB)"   ,31,size64K,   1,size32K,    2,size8K,   1,size16K  },
-    { 0x007F, 0x2249, size2MB, CMD_TYPE_AMD, "EON EN29LV160A 1Mx16 BotB  (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K }, /* bypass */
+    { 0x007F, 0x2249, size2MB, CMD_TYPE_AMD, "EON EN29LV160A 1Mx16 BotB  (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K, 0, FLASH_F_BYPASS }, /* bypass */
     { 0x007F, 0x22C4, size2MB, CMD_TYPE_AMD, "EON EN29LV160A 1Mx16 TopB  (2MB)"   ,31,size64K,   1,size32K,    2,size8K,   1,size16K  },
     { 0x0004, 0x2249, size2MB, CMD_TYPE_AMD, "MBM29LV160B 1Mx16 BotB     (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K },
     { 0x0004, 0x22c4, size2MB, CMD_TYPE_AMD, "MBM29LV160T 1Mx16 TopB     (2MB)"   ,31,size64K,   1,size32K,    2,size8K,   1,size16K  },
     { 0x00C2, 0x2249, size2MB, CMD_TYPE_AMD, "MX29LV160CB 1Mx16 BotB     (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K },
     { 0x00C2, 0x22c4, size2MB, CMD_TYPE_AMD, "MX29LV160CT 1Mx16 TopB     (2MB)"   ,31,size64K,   1,size32K,    2,size8K,   1,size16K  },
     { 0x00EC, 0x2275, size2MB, CMD_TYPE_AMD, "K8D1716UTC  1Mx16 TopB     (2MB)"   ,31,size64K,    8,size8K,     0,0,        0,0        },
-    { 0x00EC, 0x2277, size2MB, CMD_TYPE_AMD, "K8D1716UBC  1Mx16 BotB     (2MB)"   ,8,size8K,      31,size64K,   0,0,        0,0        }, /* bypass */
+    { 0x00EC, 0x2277, size2MB, CMD_TYPE_AMD, "K8D1716UBC  1Mx16 BotB     (2MB)"   ,8,size8K,      31,size64K,   0,0,        0,0, 0, FLASH_F_BYPASS }, /* bypass */
     { 0x0020, 0x2249, size2MB, CMD_TYPE_AMD, "ST M29W160EB 1Mx16 BotB    (2MB)"   ,1,size16K,    2,size8K,     1,size32K,  31,size64K },
     { 0x0020, 0x22c4, size2MB, CMD_TYPE_AMD, "ST M29W160ET 1Mx16 TopB    (2MB)"   ,31,size64K,   1,size32K,    2,size8K,   1,size16K  },
     { 0x00C2, 0x0014, size2MB, CMD_TYPE_SPI, "Macronix MX25L160A         (2MB) Serial"   ,32,size64K,   0,0,          0,0,        0,0        }, /* new */
@@ -403,16 +471,16 @@ flash_chip_type  flash_chip_list[] =
     { 0x0089, 0x88CC, size8MB, CMD_TYPE_BSC, "Intel 28F640C3 4Mx16 TopB  (8MB)"   ,127,size64K,  8,size8K,     0,0,        0,0        },
 
     /* SCS */
-    { 0x00b0, 0x00d0, size2MB, CMD_TYPE_SCS, "Intel 28F160S3/5 1Mx16     (2MB)"   ,32,size64K,   0,0,          0,0,        0,0        },
+    { 0x00b0, 0x00d0, size2MB, CMD_TYPE_SCS, "Intel 28F160S3/5 1Mx16     (2MB)"   ,32,size64K,   0,0,          0,0,        0,0, 32 },
 
-    { 0x0089, 0x0016, size4MB, CMD_TYPE_SCS, "Intel 28F320J3 2Mx16       (4MB)"   ,32,size128K,  0,0,          0,0,        0,0        },
-    { 0x0089, 0x0014, size4MB, CMD_TYPE_SCS, "Intel 28F320J5 2Mx16       (4MB)"   ,32,size128K,  0,0,          0,0,        0,0        },
-    { 0x00b0, 0x00d4, size4MB, CMD_TYPE_SCS, "Intel 28F320S3/5 2Mx16     (4MB)"   ,64,size64K,   0,0,          0,0,        0,0        },
+    { 0x0089, 0x0016, size4MB, CMD_TYPE_SCS, "Intel 28F320J3 2Mx16       (4MB)"   ,32,size128K,  0,0,          0,0,        0,0, 32 },
+    { 0x0089, 0x0014, size4MB, CMD_TYPE_SCS, "Intel 28F320J5 2Mx16       (4MB)"   ,32,size128K,  0,0,          0,0,        0,0, 32 },
+    { 0x00b0, 0x00d4, size4MB, CMD_TYPE_SCS, "Intel 28F320S3/5 2Mx16     (4MB)"   ,64,size64K,   0,0,          0,0,        0,0, 32 },
 
-    { 0x0089, 0x0017, size8MB, CMD_TYPE_SCS, "Intel 28F640J3 4Mx16       (8MB)"   ,64,size128K,  0,0,          0,0,        0,0        },
-    { 0x0089, 0x0015, size8MB, CMD_TYPE_SCS, "Intel 28F640J5 4Mx16       (8MB)"   ,64,size128K,  0,0,          0,0,        0,0        },
+    { 0x0089, 0x0017, size8MB, CMD_TYPE_SCS, "Intel 28F640J3 4Mx16       (8MB)"   ,64,size128K,  0,0,          0,0,        0,0, 32 },
+    { 0x0089, 0x0015, size8MB, CMD_TYPE_SCS, "Intel 28F640J5 4Mx16       (8MB)"   ,64,size128K,  0,0,          0,0,        0,0, 32 },
 
-    { 0x0089, 0x0018, size16MB, CMD_TYPE_SCS, "Intel 28F128J3 8Mx16      (16MB)"  ,128,size128K, 0,0,          0,0,        0,0        },
+    { 0x0089, 0x0018, size16MB, CMD_TYPE_SCS, "Intel 28F128J3 8Mx16      (16MB)"  ,128,size128K, 0,0,          0,0,        0,0, 32 },
 
     /* SST */
 
@@ -428,19 +496,19 @@ flash_chip_type  flash_chip_list[] =
     { 0x00BF, 0x236C, size8MB, CMD_TYPE_SST, "SST39VF6402B 4Mx16 TopB    (8MB)"   ,127,size64K,   8,size8K,          0,0,        0,0        },
 
 //  See Spansion hack details for reasoning for the unusual vendid
-    { 0x017E, 0x1A00, size4MB, CMD_TYPE_AMD, "Spansion S29GL032M BotB    (4MB)"   ,8,size8K,     63,size64K,   0,0,        0,0        },
-    { 0x017E, 0x1A01, size4MB, CMD_TYPE_AMD, "Spansion S29GL032M TopB    (4MB)"   ,63,size64K,     8,size8K,   0,0,        0,0        },
-    { 0x017E, 0x1000, size8MB, CMD_TYPE_AMD, "Spansion S29GL064M BotB    (8MB)"   ,8,size8K,     127,size64K,   0,0,        0,0        },
-    { 0x017E, 0x1001, size8MB, CMD_TYPE_AMD, "Spansion S29GL064M TopB    (8MB)"   ,127,size64K,     8,size8K,   0,0,        0,0        },
+    { 0x017E, 0x1A00, size4MB, CMD_TYPE_AMD, "Spansion S29GL032M BotB    (4MB)"   ,8,size8K,     63,size64K,   0,0,        0,0, 32 },
+    { 0x017E, 0x1A01, size4MB, CMD_TYPE_AMD, "Spansion S29GL032M TopB    (4MB)"   ,63,size64K,     8,size8K,   0,0,        0,0, 32 },
+    { 0x017E, 0x1000, size8MB, CMD_TYPE_AMD, "Spansion S29GL064M BotB    (8MB)"   ,8,size8K,     127,size64K,   0,0,        0,0, 32 },
+    { 0x017E, 0x1001, size8MB, CMD_TYPE_AMD, "Spansion S29GL064M TopB    (8MB)"   ,127,size64K,     8,size8K,   0,0,        0,0, 32 },
 
 // patch from OpenWRT jal2 for ti-ar7 ip8100
-	{ 0x017E, 0x1301, size8MB, CMD_TYPE_AMD, "Spansion S29GL064M U       (8MB)"   ,128,size64K,     0,0,   0,0,        0,0        },
+	{ 0x017E, 0x1301, size8MB, CMD_TYPE_AMD, "Spansion S29GL064M U       (8MB)"   ,128,size64K,     0,0,   0,0,        0,0, 32 },
 
-    { 0x017E, 0x2101, size16MB, CMD_TYPE_AMD, "Spansion S29GL128P U      (16MB)"   ,128,size128K,     0,0,   0,0,        0,0        },
-    { 0x017E, 0x1200, size16MB, CMD_TYPE_AMD, "Spansion S29GL128M U      (16MB)"   ,128,size128K,   0,0,      0,0,        0,0         },
-    { 0x017E, 0x2201, size32MB, CMD_TYPE_AMD, "Spansion S29GL256P U      (32MB)"   ,256,size128K,     0,0,   0,0,        0,0        },
-    { 0x017E, 0x2301, size64MB, CMD_TYPE_AMD, "Spansion S29GL512P U      (64MB)"   ,512,size128K,     0,0,   0,0,        0,0        },
-    { 0x017E, 0x2801, size128MB, CMD_TYPE_AMD, "Spansion S29GL01GP U     (128MB)"   ,1024,size128K,     0,0,   0,0,        0,0        },
+    { 0x017E, 0x2101, size16MB, CMD_TYPE_AMD, "Spansion S29GL128P U      (16MB)"   ,128,size128K,     0,0,   0,0,        0,0, 64 },
+    { 0x017E, 0x1200, size16MB, CMD_TYPE_AMD, "Spansion S29GL128M U      (16MB)"   ,128,size128K,   0,0,      0,0,        0,0, 32 },
+    { 0x017E, 0x2201, size32MB, CMD_TYPE_AMD, "Spansion S29GL256P U      (32MB)"   ,256,size128K,     0,0,   0,0,        0,0, 64 },
+    { 0x017E, 0x2301, size64MB, CMD_TYPE_AMD, "Spansion S29GL512P U      (64MB)"   ,512,size128K,     0,0,   0,0,        0,0, 64 },
+    { 0x017E, 0x2801, size128MB, CMD_TYPE_AMD, "Spansion S29GL01GP U     (128MB)"   ,1024,size128K,     0,0,   0,0,        0,0, 64 },
 
     { 0x0001, 0x0214, size2MB, CMD_TYPE_SPI, "Spansion S25FL016A         (2MB) Serial"   ,32,size64K,   0,0,          0,0,        0,0        }, /* new */
     { 0x0001, 0x0215, size4MB, CMD_TYPE_SPI, "Spansion S25FL032A         (4MB) Serial"   ,64,size64K,   0,0,          0,0,        0,0        }, /* new */
@@ -454,9 +522,9 @@ flash_chip_type  flash_chip_list[] =
     { 0x00EF, 0x3017, size8MB, CMD_TYPE_SPI, "Winbond W25X64             (8MB) Serial"   ,128,size64K,   0,0,          0,0,        0,0        }, /* new */
 // EON
     { 0x007f, 0x22F9, size4MB, CMD_TYPE_AMD, "EON EN29LV320 2Mx16 BotB   (4MB)"   ,8,size8K,    63,size64K,     0,0,  0,0 }, /* wrt54gl v1.1 */
-    { 0x007f, 0x22F6, size4MB, CMD_TYPE_AMD, "EON EN29LV320 2Mx16 TopB   (4MB)"   ,63,size64K,  8,size8K,    0,0,   0,0  }, /* bypass */
-    { 0x007F, 0x22C9, size8MB, CMD_TYPE_AMD, "EON EN29LV640 4Mx16 TopB   (8MB)"   ,127,size64K, 8,size8K,   0,0,        0,0        }, /* bypass */
-    { 0x007F, 0x22Cb, size8MB, CMD_TYPE_AMD, "EON EN29LV640 4Mx16 BotB   (8MB)"   ,8,size8K,    127,size64K,   0,0,        0,0        }, /* bypass */
+    { 0x007f, 0x22F6, size4MB, CMD_TYPE_AMD, "EON EN29LV320 2Mx16 TopB   (4MB)"   ,63,size64K,  8,size8K,    0,0,   0,0, 0, FLASH_F_BYPASS }, /* bypass */
+    { 0x007F, 0x22C9, size8MB, CMD_TYPE_AMD, "EON EN29LV640 4Mx16 TopB   (8MB)"   ,127,size64K, 8,size8K,   0,0,        0,0, 0, FLASH_F_BYPASS }, /* bypass */
+    { 0x007F, 0x22Cb, size8MB, CMD_TYPE_AMD, "EON EN29LV640 4Mx16 BotB   (8MB)"   ,8,size8K,    127,size64K,   0,0,        0,0, 0, FLASH_F_BYPASS }, /* bypass */
 // Atmel
     { 0x001F, 0x00C8, size4MB, CMD_TYPE_AMD, "AT49BV322A 2Mx16 BotB      (4MB)"   ,8,size8K,     63,size64K,   0,0,        0,0        },
     { 0x001F, 0x00C9, size4MB, CMD_TYPE_AMD, "AT49BV322A(T) 2Mx16 TopB   (4MB)"   ,63,size64K,     8,size8K,   0,0,        0,0        },
@@ -470,6 +538,14 @@ flash_chip_type  flash_chip_list[] =
 
 void lpt_openport(void)
 {
+    if (realtime) realtime_enter();
+
+#ifdef SIM                // ---- Simulated Target ----
+
+    sim_open();
+
+#else
+
 #ifdef WINDOWS_VERSION    // ---- Compiler Specific Code ----
 
     HANDLE h;
@@ -527,6 +603,14 @@ void lpt_openport(void)
    // Always use volatile pointer!
    gpio = (volatile unsigned *) gpio_map;
 
+   // Touch every page of the mapping now rather than in the middle of a scan
+   if (realtime)
+   {
+      int page;
+      for (page = 0; page < BLOCK_SIZE / 4; page += PAGE_SIZE / 4)
+         (void)gpio[page];
+   }
+
    // Set TDO as input and TMS,TCK and TDI as output
    
    INP_GPIO(TDO);
@@ -557,13 +641,22 @@ void lpt_openport(void)
 
 #else                  // ---- Compiler Specific Code ----
 
+#ifdef LPT_PORTIO
+    if (force_ioport)
+    {
+        portio = (ioperm(DATA_PORT, 3, 1) == 0);
+        if (!portio)
+            perror("Failed to get direct access to the port, using /dev/parport0");
+    }
+#endif
+
     pfd = open("/dev/parport0", O_RDWR);
-    if (pfd < 0)
+    if (pfd < 0 && !portio)
     {
         perror("Failed to open /dev/parport0");
         exit(0);
     }
-    if ((ioctl(pfd, PPEXCL) < 0) || (ioctl(pfd, PPCLAIM) < 0))
+    if (pfd >= 0 && ((ioctl(pfd, PPEXCL) < 0) || (ioctl(pfd, PPCLAIM) < 0)))
     {
         perror("Failed to lock /dev/parport0");
         close(pfd);
@@ -575,12 +668,28 @@ void lpt_openport(void)
 #endif
 
 #endif
+
+#endif
+
+    cable_select();
+
+#if !defined(SIM) && !defined(WINDOWS_VERSION) && !defined(RASPPI) && !defined(__FreeBSD__)
+    // Measuring clocks the TAP, so only when /ioport asked to compare; /tck
+    // reports the rate it calibrated to itself
+    printf("Parallel port: %s", portio ? "direct I/O at 0x378" : "/dev/parport0");
+    if (force_ioport && !tck_khz) printf(", %.0f kbit/s", 1e6 / tck_period_ns());
+    printf("\n\n");
+#endif
 }
 
 
 void lpt_closeport(void)
 {
-#ifndef WINDOWS_VERSION   // ---- Compiler Specific Code ----
+#ifdef SIM
+    sim_close();
+#endif
+
+#if !defined(SIM) && !defined(WINDOWS_VERSION)   // ---- Compiler Specific Code ----
 
 #ifdef RASPPI
 
@@ -588,6 +697,12 @@ void lpt_closeport(void)
 
 #ifndef __FreeBSD__    // ---- Compiler Specific Code ----
 
+#ifdef LPT_PORTIO
+    if (portio) ioperm(DATA_PORT, 3, 0);
+#endif
+
+    if (pfd < 0) return;
+
     if (ioctl(pfd, PPRELEASE) < 0)
     {
         perror("Failed to release /dev/parport0");
@@ -612,54 +727,128 @@ static void return_from_debug_mode(void)
 }
 
 
-static unsigned char clockin(int tms, int tdi)
-{
+// Shift kernel template, instantiated once per cable type below.  Each
+// kernel clocks nbits TCK cycles: bit i of tms_vec/tdi_vec (LSB first) is
+// driven on cycle i and TDO as seen on that rising edge lands in bit i of
+// tdo_vec (which may be NULL).  cable_pins[tms][tdi] holds the precomputed
+// pin pattern, LOW() drives it with TCK low, HIGH() raises TCK and TDO_IN
+// samples TDO.  PROBE() sees the VCD_* lines after each of those steps.
+#define CABLE_KERNEL(name, LOW, HIGH, TDO_IN)                                 \
+    CABLE_KERNEL_PROBED(name, LOW, HIGH, TDO_IN, NO_PROBE)
+
+#define CABLE_KERNEL_PROBED(name, LOW, HIGH, TDO_IN, PROBE)                   \
+static void name(const unsigned char *tms_vec, const unsigned char *tdi_vec,  \
+                 unsigned char *tdo_vec, int nbits)                           \
+{                                                                             \
+    int i, n;                                                                 \
+    unsigned int tms, tdi, tdo, bit, pins;                                    \
+                                                                              \
+    for (; nbits > 0; nbits -= 8)                                             \
+    {                                                                         \
+        tms = *tms_vec++;                                                     \
+        tdi = *tdi_vec++;                                                     \
+        tdo = 0;                                                              \
+        n   = (nbits < 8) ? nbits : 8;                                        \
+                                                                              \
+        for (i = 0; i < n; i++, tms >>= 1, tdi >>= 1)                         \
+        {                                                                     \
+            pins = cable_pins[tms & 1][tdi & 1];                              \
+            LOW(pins);                                                        \
+            PROBE(VCD_LINES(tms, tdi));                                       \
+            cable_wait();                                                     \
+            HIGH(pins);                                                       \
+            PROBE(VCD_LINES(tms, tdi) | VCD_TCK);                             \
+            cable_wait();                                                     \
+            bit = TDO_IN;                                                     \
+            PROBE(VCD_LINES(tms, tdi) | VCD_TCK | VCD_SAMPLE(bit));           \
+            tdo |= bit << i;                                                  \
+        }                                                                     \
+                                                                              \
+        if (tdo_vec) *tdo_vec++ = tdo;                                        \
+    }                                                                         \
+}
 
-#ifdef RASPPI
-    unsigned int data;
+static unsigned int cable_pins[2][2];
+static void (*cable_shift)(const unsigned char *tms_vec, const unsigned char *tdi_vec, unsigned char *tdo_vec, int nbits);
+
+// /vcd kernels stamp every edge into a ring.  A writer thread turns it into
+// text while the scans go on, so no file I/O happens on the scan path;
+// shift_bits() only waits for the writer, between scans, when it falls half
+// a ring behind.  vcd_head only moves here, vcd_tail only in vcd_flush().
+static struct vcd_event vcd_ring[VCD_RING];
+static unsigned long vcd_head, vcd_tail;
+
+#ifdef WINDOWS_VERSION   // ---- Compiler Specific Code ----
+#define VCD_LOAD(v)         (v)
+#define VCD_STORE(v, n)     ((v) = (n))
 #else
-    unsigned char data;
+#define VCD_LOAD(v)         __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define VCD_STORE(v, n)     __atomic_store_n(&(v), (n), __ATOMIC_RELEASE)
 #endif
 
-    tms = tms ? 1 : 0;
-    tdi = tdi ? 1 : 0;
+#define NO_PROBE(v)
+#define VCD_LINES(tms, tdi) ((((tms) & 1) << 1) | (((tdi) & 1) << 2))
+#define VCD_SAMPLE(tdo)     (VCD_SAMPLED | (tdo) * VCD_TDO)
+#define VCD_PROBE(v)                                                          \
+    do                                                                        \
+    {                                                                         \
+        vcd_ring[vcd_head & (VCD_RING - 1)].ns    = clock_ns();               \
+        vcd_ring[vcd_head & (VCD_RING - 1)].lines = (v);                      \
+        VCD_STORE(vcd_head, vcd_head + 1);                                    \
+    } while (0)
 
-#ifdef RASPPI
+#if defined(SIM)
 
-    data = (tms << TMS) | (tdi << TDI);
-    GPIO_CLR = (1 << TCK) | (1 << TMS) | (1 << TDI);
-    GPIO_SET = data;
-    cable_wait();
-    GPIO_SET = 1 << TCK;
-    cable_wait();
+// TMS in bit 1, TDI in bit 0; the target samples both on the rising edge
+static int sim_tdo;
 
-    data = GPIO_GET;
-    data = (data >> TDO) & 1;
+#define SIM_LOW(pins)
+#define SIM_HIGH(pins)      sim_tdo = sim_clock((pins) >> 1, (pins) & 1)
+#define SIM_TDO             sim_tdo
 
-#else
+CABLE_KERNEL(shift_bits_sim, SIM_LOW, SIM_HIGH, SIM_TDO)
+CABLE_KERNEL_PROBED(shift_bits_sim_vcd, SIM_LOW, SIM_HIGH, SIM_TDO, VCD_PROBE)
 
-// yoon's remark we set wtrst_n to be d4 so we are going to drive it low
-    if (wiggler) data = (1 << WTDO) | (0 << WTCK) | (tms << WTMS) | (tdi << WTDI)| (1 << WTRST_N);
-    else        data = (1 << TDO) | (0 << TCK) | (tms << TMS) | (tdi << TDI);
-    cable_wait();
+#endif
 
+#if defined(RASPPI) || defined(SIM_GPIO)
 
-#ifdef WINDOWS_VERSION   // ---- Compiler Specific Code ----
-    _outp(0x378, data);
-#else
+// Only the TMS/TDI pins that actually change are touched: falling ones go
+// out with TCK in the CLR write, rising ones get a SET write of their own.
+static unsigned int pi_level;   // TMS/TDI as last driven
+
+#define PI_LOW(pins)                                                          \
+    do                                                                        \
+    {                                                                         \
+        GPIO_CLR = (1 << TCK) | (pi_level & ~(pins));                         \
+        if ((pins) & ~pi_level) GPIO_SET = (pins) & ~pi_level;                \
+        pi_level = (pins);                                                    \
+    } while (0)
+#define PI_HIGH(pins)    GPIO_SET = 1 << TCK
+#define PI_TDO           ((GPIO_GET >> TDO) & 1)
+
+CABLE_KERNEL(shift_bits_pi, PI_LOW, PI_HIGH, PI_TDO)
 
-    ioctl(pfd, PPWDATA, &data);
 #endif
-    if (wiggler) data = (1 << WTDO) | (1 << WTCK) | (tms << WTMS) | (tdi << WTDI) | (1 << WTRST_N);
-    else        data = (1 << TDO) | (1 << TCK) | (tms << TMS) | (tdi << TDI);
-    cable_wait();
 
+#if defined(RASPPI)
+
+CABLE_KERNEL_PROBED(shift_bits_pi_vcd, PI_LOW, PI_HIGH, PI_TDO, VCD_PROBE)
 
+#elif !defined(SIM)
+
+static void pp_write(unsigned char data)
+{
 #ifdef WINDOWS_VERSION   // ---- Compiler Specific Code ----
     _outp(0x378, data);
 #else
     ioctl(pfd, PPWDATA, &data);
 #endif
+}
+
+static unsigned int pp_status(void)
+{
+    unsigned char data;
 
 #ifdef WINDOWS_VERSION   // ---- Compiler Specific Code ----
     data = (unsigned char)_inp(0x379);
@@ -667,74 +856,302 @@ static unsigned char clockin(int tms, int tdi)
     ioctl(pfd, PPRSTATUS, &data);
 #endif
 
-    data ^= 0x80;
-    data >>= wiggler?WTDO:TDO;
-    data &= 1;
+    return data ^ 0x80;   // BUSY is inverted by the port
+}
+
+#define PP_LOW(pins)        pp_write(pins)
+#define DLC5_HIGH(pins)     pp_write((pins) | (1 << TCK))
+#define DLC5_TDO            ((pp_status() >> TDO) & 1)
+#define WIGGLER_HIGH(pins)  pp_write((pins) | (1 << WTCK))
+#define WIGGLER_TDO         ((pp_status() >> WTDO) & 1)
+
+CABLE_KERNEL(shift_bits_dlc5, PP_LOW, DLC5_HIGH, DLC5_TDO)
+CABLE_KERNEL(shift_bits_wiggler, PP_LOW, WIGGLER_HIGH, WIGGLER_TDO)
+CABLE_KERNEL_PROBED(shift_bits_dlc5_vcd, PP_LOW, DLC5_HIGH, DLC5_TDO, VCD_PROBE)
+CABLE_KERNEL_PROBED(shift_bits_wiggler_vcd, PP_LOW, WIGGLER_HIGH, WIGGLER_TDO, VCD_PROBE)
+
+#ifdef LPT_PORTIO
+
+// Same cables through outb()/inb(), no syscall per access
+#define PIO_LOW(pins)           outb(pins, DATA_PORT)
+#define DLC5_PIO_HIGH(pins)     outb((pins) | (1 << TCK), DATA_PORT)
+#define DLC5_PIO_TDO            (((inb(STATUS_PORT) ^ 0x80) >> TDO) & 1)
+#define WIGGLER_PIO_HIGH(pins)  outb((pins) | (1 << WTCK), DATA_PORT)
+#define WIGGLER_PIO_TDO         (((inb(STATUS_PORT) ^ 0x80) >> WTDO) & 1)
+
+CABLE_KERNEL(shift_bits_dlc5_pio, PIO_LOW, DLC5_PIO_HIGH, DLC5_PIO_TDO)
+CABLE_KERNEL(shift_bits_wiggler_pio, PIO_LOW, WIGGLER_PIO_HIGH, WIGGLER_PIO_TDO)
+CABLE_KERNEL_PROBED(shift_bits_dlc5_pio_vcd, PIO_LOW, DLC5_PIO_HIGH, DLC5_PIO_TDO, VCD_PROBE)
+CABLE_KERNEL_PROBED(shift_bits_wiggler_pio_vcd, PIO_LOW, WIGGLER_PIO_HIGH, WIGGLER_PIO_TDO, VCD_PROBE)
 
 #endif
 
-    return data;
+#endif
+
+// Pick the kernel for the cable in use and precompute its pin patterns
+static void cable_select(void)
+{
+    int tms, tdi;
+
+    for (tms = 0; tms < 2; tms++)
+        for (tdi = 0; tdi < 2; tdi++)
+        {
+#if defined(SIM)
+            cable_pins[tms][tdi] = (tms << 1) | tdi;
+#elif defined(RASPPI)
+            cable_pins[tms][tdi] = (tms << TMS) | (tdi << TDI);
+#else
+// yoon's remark we set wtrst_n to be d4 so we are going to drive it low
+            if (wiggler) cable_pins[tms][tdi] = (1 << WTDO) | (tms << WTMS) | (tdi << WTDI) | (1 << WTRST_N);
+            else         cable_pins[tms][tdi] = (1 << TDO) | (tms << TMS) | (tdi << TDI);
+#endif
+        }
+
+#if defined(SIM)
+    cable_shift = vcd_file ? shift_bits_sim_vcd : shift_bits_sim;
+#elif defined(RASPPI)
+    GPIO_CLR = (1 << TCK) | (1 << TMS) | (1 << TDI);
+    pi_level = 0;
+    cable_shift = vcd_file ? shift_bits_pi_vcd : shift_bits_pi;
+#else
+    if (vcd_file) cable_shift = wiggler ? shift_bits_wiggler_vcd : shift_bits_dlc5_vcd;
+    else          cable_shift = wiggler ? shift_bits_wiggler : shift_bits_dlc5;
+#ifdef LPT_PORTIO
+    if (portio && vcd_file) cable_shift = wiggler ? shift_bits_wiggler_pio_vcd : shift_bits_dlc5_pio_vcd;
+    else if (portio)        cable_shift = wiggler ? shift_bits_wiggler_pio : shift_bits_dlc5_pio;
+#endif
+#endif
+}
+
+// /realtime keeps a histogram of how far each scan ran over the fastest
+// per-bit time seen at the current delay, less what reading the clock
+// costs.  /tck and /autospeed change the delay, so the baseline starts over
+// whenever it does.  Scans shorter than JITTER_MIN_BITS are mostly call
+// overhead and are left out.  Bucket n is < 100ns * 10^n.
+#define JITTER_BUCKETS  6
+#define JITTER_MIN_BITS 32
+static unsigned long jitter_hist[JITTER_BUCKETS];
+static double jitter_bit_ns;
+static unsigned int jitter_delay;
+static unsigned long long jitter_clock_ns;   // cost of a clock_ns() pair, see realtime_enter()
+
+static void jitter_record(unsigned long long elapsed, int nbits)
+{
+    double over;
+    int bucket;
+
+    if (nbits < JITTER_MIN_BITS)
+        return;
+
+    elapsed = (elapsed > jitter_clock_ns) ? elapsed - jitter_clock_ns : 0;
+
+    if (delay != jitter_delay)
+    {
+        jitter_delay  = delay;
+        jitter_bit_ns = 0;
+    }
+
+    if (!jitter_bit_ns || (double)elapsed / nbits < jitter_bit_ns)
+        jitter_bit_ns = (double)elapsed / nbits;
+
+    over = elapsed - jitter_bit_ns * nbits;
+    for (bucket = 0; bucket < JITTER_BUCKETS - 1 && over >= 100.0; bucket++)
+        over /= 10;
+    jitter_hist[bucket]++;
+}
+
+static void shift_bits(const unsigned char *tms_vec, const unsigned char *tdi_vec, unsigned char *tdo_vec, int nbits)
+{
+    unsigned long long start, end;
+
+    cost[cost_phase].tck += nbits;
+
+    if (!realtime && !trace_file)
+        cable_shift(tms_vec, tdi_vec, tdo_vec, nbits);
+    else
+    {
+        if (trace_file && !tdo_vec) tdo_vec = trace_tdo(nbits);
+
+        start = clock_ns();
+        cable_shift(tms_vec, tdi_vec, tdo_vec, nbits);
+        end = clock_ns();
+
+        if (realtime)   jitter_record(end - start, nbits);
+        if (trace_file) trace_shift(tms_vec, tdi_vec, tdo_vec, nbits, start, end);
+    }
+
+    if (vcd_file && vcd_head - VCD_LOAD(vcd_tail) >= VCD_RING / 2) vcd_wait();
 }
 
 // ---------------------------------------
 // ---- End of Compiler Specific Code ----
 // ---------------------------------------
 
-void test_reset(void)
+static void scan_put_word(unsigned char *vec, unsigned int word)
+{
+    vec[0] = word;
+    vec[1] = word >> 8;
+    vec[2] = word >> 16;
+    vec[3] = word >> 24;
+}
+
+static unsigned int scan_get_word(const unsigned char *vec)
+{
+    return vec[0] | (vec[1] << 8) | (vec[2] << 16) | ((unsigned int)vec[3] << 24);
+}
+
+// Next TAP state for TMS = 0 / TMS = 1
+static const unsigned char tap_next[TAP_STATES][2] =
+{
+    { TAP_IDLE,      TAP_RESET     },   // Test-Logic-Reset
+    { TAP_IDLE,      TAP_DRSELECT  },   // Run-Test/Idle
+    { TAP_DRCAPTURE, TAP_IRSELECT  },   // Select-DR-Scan
+    { TAP_DRSHIFT,   TAP_DREXIT1   },   // Capture-DR
+    { TAP_DRSHIFT,   TAP_DREXIT1   },   // Shift-DR
+    { TAP_DRPAUSE,   TAP_DRUPDATE  },   // Exit1-DR
+    { TAP_DRPAUSE,   TAP_DREXIT2   },   // Pause-DR
+    { TAP_DRSHIFT,   TAP_DRUPDATE  },   // Exit2-DR
+    { TAP_IDLE,      TAP_DRSELECT  },   // Update-DR
+    { TAP_IRCAPTURE, TAP_RESET     },   // Select-IR-Scan
+    { TAP_IRSHIFT,   TAP_IREXIT1   },   // Capture-IR
+    { TAP_IRSHIFT,   TAP_IREXIT1   },   // Shift-IR
+    { TAP_IRPAUSE,   TAP_IRUPDATE  },   // Exit1-IR
+    { TAP_IRPAUSE,   TAP_IREXIT2   },   // Pause-IR
+    { TAP_IRSHIFT,   TAP_IRUPDATE  },   // Exit2-IR
+    { TAP_IDLE,      TAP_DRSELECT  }    // Update-IR
+};
+
+// Shortest TMS sequence between any two states, filled in on first use
+static unsigned char tap_path_tms[TAP_STATES][TAP_STATES];
+static unsigned char tap_path_len[TAP_STATES][TAP_STATES];
+static int tap_state = TAP_UNKNOWN;
+
+static void tap_build_paths(void)
+{
+    int from, to, head, tail, state, tms;
+    int queue[TAP_STATES], seen[TAP_STATES];
+
+    for (from = 0; from < TAP_STATES; from++)
+    {
+        // Breadth first, so the first time a state is reached is the shortest way there
+        memset(seen, 0, sizeof(seen));
+        seen[from] = 1;
+        tap_path_len[from][from] = 0;
+        tap_path_tms[from][from] = 0;
+        queue[0] = from;
+        head = 0;
+        tail = 1;
+
+        while (head < tail)
+        {
+            state = queue[head++];
+            for (tms = 0; tms < 2; tms++)
+            {
+                to = tap_next[state][tms];
+                if (seen[to])
+                    continue;
+                seen[to] = 1;
+                tap_path_len[from][to] = tap_path_len[from][state] + 1;
+                tap_path_tms[from][to] = tap_path_tms[from][state] | (tms << tap_path_len[from][state]);
+                queue[tail++] = to;
+            }
+        }
+    }
+}
+
+// Walk the TAP to the given state along the shortest TMS path
+static void tap_goto(int state)
+{
+    static const unsigned char zeros = 0;
+    static int paths_built = 0;
+
+    if (!paths_built)
+    {
+        tap_build_paths();
+        paths_built = 1;
+    }
+
+    if (tap_state == TAP_UNKNOWN)
+        test_reset();
+
+    if (tap_path_len[tap_state][state])
+        shift_bits(&tap_path_tms[tap_state][state], &zeros, NULL, tap_path_len[tap_state][state]);
+    tap_state = state;
+}
+
+// Shift nbits through the instruction (ir != 0) or data register.  The TAP
+// is parked in Update-IR/DR afterwards, so back to back scans go straight
+// on to Select-DR-Scan without a detour through Run-Test/Idle.  in_vec and
+// out_vec are packed LSB first.
+static void jtag_scan(int ir, const unsigned char *in_vec, unsigned char *out_vec, int nbits)
 {
-    clockin(1, 0);  // Run through a handful of clock cycles with TMS high to make sure
-    clockin(1, 0);  // we are in the TEST-LOGIC-RESET state.
-    clockin(1, 0);
-    clockin(1, 0);
-    clockin(1, 0);
-    clockin(0, 0);  // enter runtest-idle
+    unsigned char tms_vec[SCAN_BYTES(MAX_SCAN_BITS)];
+
+    memset(tms_vec, 0, SCAN_BYTES(nbits));
+    SCAN_SET(tms_vec, nbits - 1);               // leave shift on the last bit
+
+    if (ir) cost[cost_phase].ir_scans++;
+    else    cost[cost_phase].dr_scans++;
+
+    tap_goto(ir ? TAP_IRSHIFT : TAP_DRSHIFT);
+    shift_bits(tms_vec, in_vec, out_vec, nbits);
+    tap_state = ir ? TAP_IREXIT1 : TAP_DREXIT1;
+    tap_goto(ir ? TAP_IRUPDATE : TAP_DRUPDATE);
 }
 
 static int curinstr = 0xFFFFFFFF;
+
+void test_reset(void)
+{
+    // Run through a handful of clock cycles with TMS high to make sure
+    // we are in the TEST-LOGIC-RESET state, then enter runtest-idle.
+    static const unsigned char tms_vec = 0x1F, tdi_vec = 0x00;
+
+    shift_bits(&tms_vec, &tdi_vec, NULL, 6);
+    tap_state = TAP_IDLE;
+
+    // The IR now holds IDCODE (or BYPASS), not whatever we last loaded
+    curinstr = 0xFFFFFFFF;
+}
+
 void set_instr(int instr)
 {
-    int i;
+    unsigned char in_vec[4];
 
-    if (instr == curinstr)
-        return;
+    USDT1(set_instr__entry, instr);
 
-    clockin(1, 0);  // enter select-dr-scan
-    clockin(1, 0);  // enter select-ir-scan
-    clockin(0, 0);  // enter capture-ir
-    clockin(0, 0);  // enter shift-ir (dummy)
-    for (i=0; i < instruction_length; i++)
+    if (instr == curinstr)
     {
-        clockin(i==(instruction_length - 1), (instr>>i)&1);
+        cost[cost_phase].ir_cached++;
+        USDT1(set_instr__return, 0);
+        return;
     }
-    clockin(1, 0);  // enter update-ir
-    clockin(0, 0);  // enter runtest-idle
+
+    scan_put_word(in_vec, instr);
+    jtag_scan(1, in_vec, NULL, instruction_length);
 
     curinstr = instr;
+    USDT1(set_instr__return, 1);
 }
 
 
 static unsigned int ReadWriteData(unsigned int in_data)
 {
-    int i;
-    unsigned int out_data = 0;
-    unsigned char out_bit;
+    unsigned int out_data;
+    unsigned char in_vec[4], out_vec[4];
+
+    USDT2(ReadWriteData__entry, curinstr, in_data);
 
     if (DEBUG) printf("INSTR: 0x%04x  ", curinstr);
     if (DEBUG) printf("W: 0x%08x ", in_data);
 
-    clockin(1, 0);  // enter select-dr-scan
-    clockin(0, 0);  // enter capture-dr
-    clockin(0, 0);  // enter shift-dr
-    for (i = 0 ; i < 32 ; i++)
-    {
-        out_bit  = clockin((i == 31), ((in_data >> i) & 1));
-        out_data = out_data | (out_bit << i);
-    }
-    clockin(1,0);   // enter update-dr
-    clockin(0,0);   // enter runtest-idle
+    scan_put_word(in_vec, in_data);
+    jtag_scan(0, in_vec, out_vec, 32);
+    out_data = scan_get_word(out_vec);
 
     if (DEBUG) printf("R: 0x%08x\n", out_data);
 
+    USDT1(ReadWriteData__return, out_data);
     return out_data;
 }
 
@@ -808,11 +1225,34 @@ void ejtag_write_h(unsigned int addr, unsigned int data)
     else ejtag_pracc_write_h(addr, data);
 }
 
+// Read/write count consecutive words starting at addr
+static void ejtag_read_block(unsigned int addr, unsigned int *buf, int count)
+{
+    int i;
+
+    if (USE_DMA && USE_ALL) ejtag_dma_burst(addr, buf, count, 0);
+    else if (!USE_DMA && USE_FASTDATA && !ejtag_fastdata_block(addr, buf, count, 0)) return;
+    else if (!USE_DMA) ejtag_pracc_read_block(addr, buf, count);
+    else for (i = 0; i < count; i++) buf[i] = ejtag_read(addr + 4 * i);
+}
+
+static void ejtag_write_block(unsigned int addr, unsigned int *buf, int count)
+{
+    int i;
+
+    if (USE_DMA && USE_ALL) ejtag_dma_burst(addr, buf, count, 1);
+    else if (!USE_DMA && USE_FASTDATA && !ejtag_fastdata_block(addr, buf, count, 1)) return;
+    else if (!USE_DMA) ejtag_pracc_write_block(addr, buf, count);
+    else for (i = 0; i < count; i++) ejtag_write(addr + 4 * i, buf[i]);
+}
+
 static unsigned int ejtag_dma_read(unsigned int addr)
 {
     unsigned int data;
     int retries = RETRY_ATTEMPTS;
 
+    USDT2(dma_read__entry, addr, 4);
+
 begin_ejtag_dma_read:
 
     // Setup Address
@@ -838,10 +1278,11 @@ begin_ejtag_dma_read:
     set_instr(INSTR_CONTROL);
     if (ReadWriteData(PROBEN | PRACC) & DERR)
     {
-        if (retries--)  goto begin_ejtag_dma_read;
+        if (retries--)  { dma_backoff(retries); goto begin_ejtag_dma_read; }
         else  printf("DMA Read Addr = %08x  Data = (%08x)ERROR ON READ\n", addr, data);
     }
 
+    USDT2(dma_read__return, addr, data);
     return(data);
 
 
@@ -852,6 +1293,8 @@ static unsigned int ejtag_dma_read_h(unsigned int addr)
     unsigned int data;
     int retries = RETRY_ATTEMPTS;
 
+    USDT2(dma_read__entry, addr, 2);
+
 begin_ejtag_dma_read_h:
 
     // Setup Address
@@ -873,7 +1316,7 @@ begin_ejtag_dma_read_h:
     set_instr(INSTR_CONTROL);
     if (ReadWriteData(PROBEN | PRACC) & DERR)
     {
-        if (retries--)  goto begin_ejtag_dma_read_h;
+        if (retries--)  { dma_backoff(retries); goto begin_ejtag_dma_read_h; }
         else  printf("DMA Read Addr = %08x  Data = (%08x)ERROR ON READ\n", addr, data);
     }
     // Handle the bigendian / littleendian
@@ -883,6 +1326,7 @@ begin_ejtag_dma_read_h:
     else
         data = (data&0x0000ffff);
 
+    USDT2(dma_read__return, addr, data);
     return(data);
 
 }
@@ -891,6 +1335,8 @@ void ejtag_dma_write(unsigned int addr, unsigned int data)
 {
     int   retries = RETRY_ATTEMPTS;
 
+    USDT2(dma_write__entry, addr, 4);
+
 begin_ejtag_dma_write:
 
     // Setup Address
@@ -912,9 +1358,10 @@ begin_ejtag_dma_write:
     set_instr(INSTR_CONTROL);
     if (ReadWriteData(PROBEN | PRACC) & DERR)
     {
-        if (retries--)  goto begin_ejtag_dma_write;
+        if (retries--)  { dma_backoff(retries); goto begin_ejtag_dma_write; }
         else  printf("DMA Write Addr = %08x  Data = ERROR ON WRITE\n", addr);
     }
+    USDT2(dma_write__return, addr, data);
 }
 
 
@@ -922,6 +1369,8 @@ void ejtag_dma_write_h(unsigned int addr, unsigned int data)
 {
     int   retries = RETRY_ATTEMPTS;
 
+    USDT2(dma_write__entry, addr, 2);
+
 begin_ejtag_dma_write_h:
 
     // Setup Address
@@ -943,9 +1392,88 @@ begin_ejtag_dma_write_h:
     set_instr(INSTR_CONTROL);
     if (ReadWriteData(PROBEN | PRACC) & DERR)
     {
-        if (retries--)  goto begin_ejtag_dma_write_h;
+        if (retries--)  { dma_backoff(retries); goto begin_ejtag_dma_write_h; }
         else  printf("DMA Write Addr = %08x  Data = ERROR ON WRITE\n", addr);
     }
+    USDT2(dma_write__return, addr, data);
+}
+
+// One scan of the ALL register: control sits nearest TDO, then data, then
+// address.  Returns the captured control, *data_out gets the captured data.
+static unsigned int ejtag_all_scan(unsigned int addr, unsigned int data, unsigned int ctrl, unsigned int *data_out)
+{
+    unsigned char in_vec[12], out_vec[12];
+
+    scan_put_word(in_vec, ctrl);
+    scan_put_word(in_vec + 4, data);
+    scan_put_word(in_vec + 8, addr);
+    jtag_scan(0, in_vec, out_vec, 96);
+
+    if (data_out) *data_out = scan_get_word(out_vec + 4);
+    return scan_get_word(out_vec);
+}
+
+// Let a DMA access still in flight finish, then drop DMAACC
+static void ejtag_dma_settle(void)
+{
+    set_instr(INSTR_CONTROL);
+    while (ReadWriteData(DMAACC | PROBEN | PRACC) & DSTRT);
+    ReadWriteData(PROBEN | PRACC);
+}
+
+// Pipelined word DMA through the ALL register.  Each scan starts the
+// access for word i and, in the same scan, captures the status (and for
+// reads the data) of word i-1, so a word costs a single 96 bit DR scan.
+// A word whose access had not finished or flagged DERR by the time it was
+// captured is redone the slow way and the pipeline restarted behind it.
+//
+// The Update-DR that captured a busy word i-1 has already loaded word i
+// with DSTRT, so that access may still be carried out before the DMA is
+// settled, and word i-1 then lands after it.  Repeated or reordered
+// accesses are harmless for reads and for RAM, but not for flash command
+// cycles, so only use this for plain memory: flash commands must go
+// through ejtag_write()/ejtag_write_h() one at a time.
+static void ejtag_dma_burst(unsigned int addr, unsigned int *buf, int count, int write)
+{
+    unsigned int start = DMAACC | DMA_WORD | DSTRT | PROBEN | PRACC | (write ? 0 : DRWN);
+    unsigned int ctrl, data;
+    int i;
+
+    if (count <= 0)
+        return;
+
+    USDT2(dma_burst__entry, addr, count);
+
+    set_instr(INSTR_ALL);
+    ejtag_all_scan(addr, write ? buf[0] : 0, start, NULL);
+
+    for (i = 1; i <= count; i++)
+    {
+        // Start word i, or wind the DMA down after the last word
+        if (i < count)
+            ctrl = ejtag_all_scan(addr + 4 * i, write ? buf[i] : 0, start, &data);
+        else
+            ctrl = ejtag_all_scan(addr + 4 * i, 0, PROBEN | PRACC, &data);
+
+        if (ctrl & (DSTRT | DERR))
+        {
+            ejtag_dma_settle();
+            if (write)
+                ejtag_dma_write(addr + 4 * (i - 1), buf[i - 1]);
+            else
+                buf[i - 1] = ejtag_dma_read(addr + 4 * (i - 1));
+
+            if (i < count)
+            {
+                set_instr(INSTR_ALL);
+                ejtag_all_scan(addr + 4 * i, write ? buf[i] : 0, start, NULL);
+            }
+        }
+        else if (!write)
+            buf[i - 1] = data;
+    }
+
+    USDT2(dma_burst__return, addr, count);
 }
 
 static unsigned int ejtag_pracc_read(unsigned int addr)
@@ -979,6 +1507,34 @@ void ejtag_pracc_write_h(unsigned int addr, unsigned int data)
     ExecuteDebugModule(pracc_writehalf_code_module);
 }
 
+// Block versions: the module loops over count words itself, so the
+// prologue is fed once per block rather than once per word
+void ejtag_pracc_read_block(unsigned int addr, unsigned int *buf, int count)
+{
+    if (count <= 0)
+        return;
+
+    address_register = addr | 0xA0000000;  // Force to use uncached segment
+    count_register   = count;
+    block_buffer     = buf;
+    block_index      = 0;
+    ExecuteDebugModule(pracc_readblock_code_module);
+    block_buffer     = NULL;
+}
+
+void ejtag_pracc_write_block(unsigned int addr, unsigned int *buf, int count)
+{
+    if (count <= 0)
+        return;
+
+    address_register = addr | 0xA0000000;  // Force to use uncached segment
+    count_register   = count;
+    block_buffer     = buf;
+    block_index      = 0;
+    ExecuteDebugModule(pracc_writeblock_code_module);
+    block_buffer     = NULL;
+}
+
 void setup_memory_4712(void)
 {
     printf("Configuring SDRAM... ");
@@ -1156,6 +1712,7 @@ void ExecuteDebugModule(unsigned int *pmodule)
     int finished = 0;
     int DEBUGMSG = 0;
 
+    USDT1(ExecuteDebugModule__entry, pmodule);
     if (DEBUGMSG) printf("DEBUGMODULE: Start module.\n");
 
     // Feed the chip an array of 32 bit values into the processor via the EJTAG port as instructions.
@@ -1167,7 +1724,10 @@ void ExecuteDebugModule(unsigned int *pmodule)
             set_instr(INSTR_CONTROL);
             ctrl_reg = ReadWriteData(PRACC | PROBEN | SETDEV);
             if (ctrl_reg & PRACC)
+            {
+                cost[cost_phase].pracc++;
                 break;
+            }
             if (DEBUGMSG) printf("DEBUGMODULE: No memory access in progress!\n");
         }
 
@@ -1190,7 +1750,11 @@ void ExecuteDebugModule(unsigned int *pmodule)
             // Handle Debug Write
             // If processor is writing to one of our psuedo virtual registers then save off data
             if (address == MIPS_VIRTUAL_ADDRESS_ACCESS)  address_register = data;
-            if (address == MIPS_VIRTUAL_DATA_ACCESS)     data_register    = data;
+            if (address == MIPS_VIRTUAL_DATA_ACCESS)
+            {
+                if (block_buffer)  block_buffer[block_index++] = data;
+                else               data_register = data;
+            }
         }
 
         else
@@ -1204,6 +1768,7 @@ void ExecuteDebugModule(unsigned int *pmodule)
                 if (finished++) // Allows ONE pass
                 {
                     if (DEBUGMSG) printf("DEBUGMODULE: Finished module.\n");
+                    USDT1(ExecuteDebugModule__return, pmodule);
                     return;
                 }
             }
@@ -1223,7 +1788,8 @@ void ExecuteDebugModule(unsigned int *pmodule)
                 // Handle Debug Read
                 // If processor is reading from one of our psuedo virtual registers then give it data
                 if (address == MIPS_VIRTUAL_ADDRESS_ACCESS)  data = address_register;
-                if (address == MIPS_VIRTUAL_DATA_ACCESS)     data = data_register;
+                if (address == MIPS_VIRTUAL_DATA_ACCESS)     data = block_buffer ? block_buffer[block_index++] : data_register;
+                if (address == MIPS_VIRTUAL_COUNT_ACCESS)    data = count_register;
             }
 
             // Send the data out
@@ -1238,57 +1804,232 @@ void ExecuteDebugModule(unsigned int *pmodule)
     }
 }
 
-void chip_detect(void)
+
+// One scan of the 33 bit FASTDATA register.  SPrAcc sits nearest TDO and
+// shifting a 0 into it completes the pending access.  Returns the captured
+// SPrAcc, i.e. whether there was an access to complete.
+static int ejtag_fastdata_scan(unsigned int in_data, unsigned int *out_data)
 {
-    unsigned int id = 0x0;
+    unsigned char in_vec[5], out_vec[5];
 
-    processor_chip_type*   processor_chip = processor_chip_list;
+    in_vec[0] = in_data << 1;
+    in_vec[1] = in_data >> 7;
+    in_vec[2] = in_data >> 15;
+    in_vec[3] = in_data >> 23;
+    in_vec[4] = in_data >> 31;
+    jtag_scan(0, in_vec, out_vec, 33);
 
-    lpt_openport();
+    if (out_data) *out_data = (out_vec[0] >> 1) | (out_vec[1] << 7) | (out_vec[2] << 15) | (out_vec[3] << 23) | ((unsigned int)out_vec[4] << 31);
+    return out_vec[0] & 1;
+}
 
-    printf("Probing bus ... ");
+// Hand one word to (or take one from) the handler, waiting for it to get
+// there.  Returns -1 if the handler never asks for it.
+static int ejtag_fastdata_xfer(unsigned int in_data, unsigned int *out_data)
+{
+    int retries = RETRY_ATTEMPTS;
 
-    if (skipdetect)
-    {
-        // Manual Override CPU Chip ID
-        test_reset();
-        instruction_length = instrlen;
-        set_instr(INSTR_IDCODE);
-        id = ReadData();
-        printf("Done\n\n");
-        printf("Instruction Length set to %d\n\n",instruction_length);
-        printf("CPU Chip ID: ");
-        ShowData(id);
-        printf("*** CHIP DETECTION OVERRIDDEN ***\n\n");
-        return;
-    }
-    else
+    while (!ejtag_fastdata_scan(in_data, out_data))
     {
-        // Auto Detect CPU Chip ID
-        while (processor_chip->chip_id)
+        if (!retries--)
         {
-            test_reset();
-            if (instrlen)
-                instruction_length = instrlen;
-            else
-                instruction_length = processor_chip->instr_length;
-            set_instr(INSTR_IDCODE);
-            id = ReadData();
-            if (id == processor_chip->chip_id)
-            {
-                printf("Done\n\n");
-                printf("Instruction Length set to %d\n\n",instruction_length);
-                printf("CPU Chip ID: ");
-                ShowData(id);
-                printf("*** Found a %s chip ***\n\n", processor_chip->chip_descr);
-                proc_id = id;
-
-                return;
-            }
-            processor_chip++;
+            printf("FASTDATA handler at %08x is not responding\n", workarea);
+            return -1;
         }
     }
-
+    cost[cost_phase].pracc++;
+    return 0;
+}
+
+// Feed the processor the instructions of pmodule until its first access to
+// the FASTDATA area, which is left pending for ejtag_fastdata_xfer().
+static void ejtag_fastdata_enter(unsigned int *pmodule, int words)
+{
+    unsigned int address, offset;
+
+    while (1)
+    {
+        set_instr(INSTR_CONTROL);
+        while (!(ReadWriteData(PRACC | PROBEN | SETDEV) & PRACC));
+
+        set_instr(INSTR_ADDRESS);
+        address = ReadData();
+        if (address <= MIPS_FASTDATA_AREA_END)
+            break;
+
+        // Anything fetched past the end of the module is a nop
+        offset = (address - MIPS_DEBUG_VECTOR_ADDRESS) / 4;
+        set_instr(INSTR_DATA);
+        ReadWriteData(offset < words ? pmodule[offset] : 0x00000000);
+
+        set_instr(INSTR_CONTROL);
+        ReadWriteData(PROBEN | SETDEV);
+    }
+    set_instr(INSTR_FASTDATA);
+}
+
+static unsigned int *fastdata_handler = NULL;
+static unsigned int workarea_save[FASTDATA_HANDLER_WORDS];
+
+// A handler that lost step with us is still looping in the workarea.  Let
+// it run out by completing its remaining FASTDATA accesses the plain PrAcc
+// way until it fetches the debug vector again, which is left pending for
+// the next ExecuteDebugModule().  done of the total accesses went through
+// already; the two header words are handed over again, loads past them get
+// 0.  Returns -1 if the processor stops asking or goes anywhere else.
+static int ejtag_fastdata_stop(const unsigned int *header, int done, int total)
+{
+    unsigned int address;
+    int retries;
+
+    for (; done <= total; done++)
+    {
+        set_instr(INSTR_CONTROL);
+        for (retries = RETRY_ATTEMPTS; !(ReadWriteData(PRACC | PROBEN | SETDEV) & PRACC); )
+            if (!retries--) return -1;
+
+        set_instr(INSTR_ADDRESS);
+        address = ReadData();
+        if (address == MIPS_DEBUG_VECTOR_ADDRESS)
+            return 0;
+        if (address > MIPS_FASTDATA_AREA_END)
+            return -1;
+
+        set_instr(INSTR_DATA);
+        ReadWriteData(done < 2 ? header[done] : 0);
+        set_instr(INSTR_CONTROL);
+        ReadWriteData(PROBEN | SETDEV);
+    }
+    return -1;
+}
+
+// Block transfer through a FASTDATA handler running from the workarea.
+// Returns -1 if the handler stopped responding: it has then been stopped,
+// the workarea put back and FASTDATA turned off, so the caller can redo the
+// block through plain PrAcc.  If the handler cannot be stopped either the
+// target is lost and the run ends here.
+static int ejtag_fastdata_block(unsigned int addr, unsigned int *buf, int count, int write)
+{
+    unsigned int *handler = write ? fastdata_write_handler : fastdata_read_handler;
+    unsigned int jump_module[6], header[2];
+    unsigned int i, data;
+    int done;
+
+    if (count <= 0)
+        return 0;
+
+    // Keep what the handler overwrites, ejtag_fastdata_release() puts it back
+    if (fastdata_handler == NULL)
+        for (i = 0; i < FASTDATA_HANDLER_WORDS; i++)
+            workarea_save[i] = ejtag_pracc_read(workarea + 4 * i);
+
+    if (fastdata_handler != handler)
+    {
+        for (i = 0; i < FASTDATA_HANDLER_WORDS; i++)
+            ejtag_pracc_write(workarea + 4 * i, handler[i]);
+        fastdata_handler = handler;
+    }
+
+    jump_module[0] = 0x3C0F0000 | (workarea >> 16);      // lui $15, workarea_hi
+    jump_module[1] = 0x35EF0000 | (workarea & 0xFFFF);   // ori $15, workarea_lo
+    jump_module[2] = 0x01E00008;                         // jr $15
+    jump_module[3] = 0x00000000;                         // nop
+    jump_module[4] = 0x00000000;
+    jump_module[5] = 0x00000000;
+    ejtag_fastdata_enter(jump_module, 6);
+
+    header[0] = addr | 0xA0000000;  // Force to use uncached segment
+    header[1] = count;
+    for (done = 0; done < 2; done++)
+        if (ejtag_fastdata_xfer(header[done], &data)) break;
+
+    if (done == 2)
+        for (i = 0; i < count; i++, done++)
+            if (ejtag_fastdata_xfer(write ? buf[i] : 0, write ? &data : &buf[i])) break;
+
+    if (done == count + 2)
+        return 0;
+
+    if (ejtag_fastdata_stop(header, done, count + 2))
+    {
+        printf("FASTDATA handler could not be stopped, the %d bytes at %08x were not restored\n",
+               (int)(4 * FASTDATA_HANDLER_WORDS), workarea);
+        fastdata_handler = NULL;
+        chip_shutdown();
+        exit(1);
+    }
+
+    ejtag_fastdata_release();
+    USE_FASTDATA = 0;
+    printf("FASTDATA turned off, carrying on through PrAcc\n");
+    return -1;
+}
+
+void ejtag_fastdata_release(void)
+{
+    unsigned int i;
+
+    if (fastdata_handler == NULL)
+        return;
+
+    for (i = 0; i < FASTDATA_HANDLER_WORDS; i++)
+        ejtag_pracc_write(workarea + 4 * i, workarea_save[i]);
+    fastdata_handler = NULL;
+}
+
+void chip_detect(void)
+{
+    unsigned int id = 0x0;
+
+    processor_chip_type*   processor_chip = processor_chip_list;
+
+    lpt_openport();
+
+    if (tck_khz) tck_calibrate();
+
+    printf("Probing bus ... ");
+
+    if (skipdetect)
+    {
+        // Manual Override CPU Chip ID
+        test_reset();
+        instruction_length = instrlen;
+        set_instr(INSTR_IDCODE);
+        id = ReadData();
+        printf("Done\n\n");
+        printf("Instruction Length set to %d\n\n",instruction_length);
+        printf("CPU Chip ID: ");
+        ShowData(id);
+        printf("*** CHIP DETECTION OVERRIDDEN ***\n\n");
+        return;
+    }
+    else
+    {
+        // Auto Detect CPU Chip ID
+        while (processor_chip->chip_id)
+        {
+            test_reset();
+            if (instrlen)
+                instruction_length = instrlen;
+            else
+                instruction_length = processor_chip->instr_length;
+            set_instr(INSTR_IDCODE);
+            id = ReadData();
+            if (id == processor_chip->chip_id)
+            {
+                printf("Done\n\n");
+                printf("Instruction Length set to %d\n\n",instruction_length);
+                printf("CPU Chip ID: ");
+                ShowData(id);
+                printf("*** Found a %s chip ***\n\n", processor_chip->chip_descr);
+                proc_id = id;
+
+                return;
+            }
+            processor_chip++;
+        }
+    }
+
     printf("Done\n\n");
     printf("Instruction Length set to %d\n\n",instruction_length);
     printf("CPU Chip ID: ");
@@ -1347,6 +2088,17 @@ void check_ejtag_features()
         printf("    *** DMA Mode Forced Off ***\n");
     }
 
+    // Pipelined DMA through the ALL register.  Not on the Gv8, whose DSTRT
+    // we never wait on.
+    USE_ALL = USE_DMA && !force_noall && ((proc_id & 0xfffffff) != 0x535417f);
+    if (USE_DMA)
+        printf("    - EJTAG ALL DMA ....... : %s\n", USE_ALL ? "Yes" : "No");
+
+    // FASTDATA block transfers for PrAcc targets, EJTAG 2.6 and up
+    USE_FASTDATA = force_fastdata && !USE_DMA && (ejtag_version >= 2);
+    if (force_fastdata)
+        printf("    - EJTAG FASTDATA ...... : %s\n", USE_FASTDATA ? "Yes" : "No (needs PrAcc and EJTAG 2.6+)");
+
     printf("\n");
 }
 
@@ -1354,8 +2106,15 @@ void check_ejtag_features()
 void chip_shutdown(void)
 {
     fflush(stdout);
+    if (bypass_mode) unlock_bypass_reset();
+    ejtag_fastdata_release();
     test_reset();
+    trace_close();
+    vcd_close();
+    cost_report();
+    report_write();
     lpt_closeport();
+    if (realtime) realtime_report();
 }
 
 void
@@ -1369,12 +2128,630 @@ cable_wait( void )
 }
 
 
+static unsigned long long clock_ns(void)
+{
+#ifdef WINDOWS_VERSION   // ---- Compiler Specific Code ----
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (unsigned long long)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+#define TCK_CAL_BITS    1024
+#define TCK_CAL_RUNS    5
+
+// Nanoseconds per TCK with the current delay, clocked in Run-Test/Idle.
+// The fastest of a few runs is kept so a preempted run does not skew it.
+static double tck_period_ns(void)
+{
+    static const unsigned char idle[SCAN_BYTES(TCK_CAL_BITS)];
+    unsigned long long start, elapsed, best = ~0ULL;
+    int run;
+
+    tap_goto(TAP_IDLE);
+
+    for (run = 0; run < TCK_CAL_RUNS; run++)
+    {
+        start = clock_ns();
+        shift_bits(idle, idle, NULL, TCK_CAL_BITS);
+        elapsed = clock_ns() - start;
+        if (elapsed < best) best = elapsed;
+    }
+
+    return (double)best / TCK_CAL_BITS;
+}
+
+
+// Pick the cable_wait() spin count that gives /tck:<kHz>. The period is
+// linear in the spin count, so two measurements give the fit and a couple
+// of measured corrections take care of the rest.
+void tck_calibrate(void)
+{
+    double target, base, slope, period, d;
+    int pass;
+
+    target = 1e6 / tck_khz;
+
+    printf("Calibrating TCK for %u kHz ... ", tck_khz);
+
+    delay = 0;
+    base = tck_period_ns();
+
+    delay = 1000;
+    slope = (tck_period_ns() - base) / delay;
+    if (slope <= 0) slope = 1e-3;
+
+    d = (target - base) / slope;
+    for (pass = 0; pass < 3; pass++)
+    {
+        delay = (d > 0) ? (unsigned int)(d + 0.5) : 0;
+        period = tck_period_ns();
+        if (!delay && period >= target) break;
+        d = delay + (target - period) / slope;
+    }
+
+    printf("Done\n");
+    printf("TCK: %.0f kHz requested, %.0f kHz achieved (delay %u)\n\n", 1e6 / target, 1e6 / period, delay);
+    if (period > target * 1.05)
+        printf("*** Requested TCK is above what this cable can do ***\n\n");
+}
+
+
+// /autospeed walks this ladder of cable_wait() spin counts, slowest first
+#define SPEED_RUNGS         16
+#define SPEED_DELAY(r)      ((r) ? (1u << ((r) - 1)) : 0)
+#define SPEED_TRIALS        16
+#define SPEED_DMA_ADDR      0x1FC00000      // boot vector, always backed by flash
+
+// Scans that must read back the same at every speed: IDCODE, IMPCODE and a
+// DMA read, the IR toggling between them.  Returns the number of bad reads.
+static int speed_trial(unsigned int impcode, unsigned int dma_word)
+{
+    unsigned int retries;
+    int i, errors = 0;
+
+    for (i = 0; i < SPEED_TRIALS; i++)
+    {
+        set_instr(INSTR_IDCODE);
+        if (ReadData() != proc_id) errors++;
+        set_instr(INSTR_IMPCODE);
+        if (ReadData() != impcode) errors++;
+        if (USE_DMA)
+        {
+            retries = dma_retries;
+            if (ejtag_dma_read(SPEED_DMA_ADDR) != dma_word) errors++;
+            errors += dma_retries - retries;
+        }
+    }
+
+    return errors;
+}
+
+// Find the fastest rung with no bit errors, then settle one rung slower
+void speed_autotune(void)
+{
+    unsigned int impcode, dma_word = 0;
+    int rung, clean = -1;
+
+    printf("Tuning link speed ... ");
+
+    delay = SPEED_DELAY(SPEED_RUNGS - 1);
+    set_instr(INSTR_IMPCODE);
+    impcode = ReadData();
+    if (USE_DMA) dma_word = ejtag_dma_read(SPEED_DMA_ADDR);
+
+    for (rung = SPEED_RUNGS - 1; rung >= 0; rung--)
+    {
+        delay = SPEED_DELAY(rung);
+        if (speed_trial(impcode, dma_word)) break;
+        clean = rung;
+    }
+
+    if (clean < 0)
+    {
+        delay = SPEED_DELAY(SPEED_RUNGS - 1);
+        printf("Failed\n");
+        printf("*** Errors even at the slowest speed, check the cable ***\n\n");
+        return;
+    }
+
+    speed_rung = (clean < SPEED_RUNGS - 1) ? clean + 1 : clean;
+    delay = SPEED_DELAY(speed_rung);
+
+    printf("Done\n");
+    printf("TCK: fastest clean delay %u, using delay %u (%.0f kHz)\n\n",
+           SPEED_DELAY(clean), delay, 1e6 / tck_period_ns());
+}
+
+// The DMA routines retry on DERR; after /autospeed a second DERR in a row
+// on one access is taken as the link being too fast and it is slowed down.
+void dma_backoff(int retries)
+{
+    dma_retries++;
+    cost[cost_phase].dma_retries++;
+
+    if (speed_rung < 0 || speed_rung >= SPEED_RUNGS - 1) return;
+    if (retries != RETRY_ATTEMPTS - 2) return;
+
+    speed_rung++;
+    delay = SPEED_DELAY(speed_rung);
+    printf("*** DMA errors, slowing TCK down to delay %u ***\n", delay);
+}
+
+
+// /realtime: lock memory, run SCHED_FIFO and stay on one CPU, by default
+// the last one, which is the one usually kept free with isolcpus=
+void realtime_enter(void)
+{
+    unsigned long long start;
+    int i;
+
+#ifdef __linux__
+    struct sched_param param;
+    cpu_set_t cpus;
+    volatile char stack[65536];
+    int cpu;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        perror("Failed to lock memory");
+
+    // Fault in the stack we will be running on while it is still cheap
+    memset((char *)stack, 0, sizeof(stack));
+
+    cpu = (realtime_cpu >= 0) ? realtime_cpu : (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        perror("Failed to set CPU affinity");
+
+    param.sched_priority = REALTIME_PRIORITY;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        perror("Failed to set SCHED_FIFO");
+    else
+        printf("Realtime: SCHED_FIFO priority %d on CPU %d\n\n", REALTIME_PRIORITY, cpu);
+#else
+    printf("*** /realtime is only supported on Linux ***\n\n");
+#endif
+
+    // What timing a scan costs by itself, the cheapest of a few tries
+    for (i = 0, jitter_clock_ns = ~0ULL; i < 16; i++)
+    {
+        start = clock_ns();
+        start = clock_ns() - start;
+        if (start < jitter_clock_ns) jitter_clock_ns = start;
+    }
+}
+
+void realtime_report(void)
+{
+    static const char *label[JITTER_BUCKETS] = { "< 100 ns", "< 1 us", "< 10 us", "< 100 us", "< 1 ms", ">= 1 ms" };
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < JITTER_BUCKETS; i++) total += jitter_hist[i];
+    if (!total) return;
+
+    printf("\nPer-scan jitter over %lu scans of %d bits or more (fastest %.1f ns/bit at delay %u):\n",
+           total, JITTER_MIN_BITS, jitter_bit_ns, jitter_delay);
+    for (i = 0; i < JITTER_BUCKETS; i++)
+        printf("    %-9s : %10lu  (%5.1f%%)\n", label[i], jitter_hist[i], 100.0 * jitter_hist[i] / total);
+}
+
+
+// Charge everything from here on to phase, and the time since the last
+// switch to the phase we are leaving
+void cost_enter(int phase)
+{
+    unsigned long long now = clock_ns();
+
+    if (cost_mark) cost[cost_phase].ns += now - cost_mark;
+    cost_mark  = now;
+    cost_phase = phase;
+}
+
+static const char *phase_name[PHASES] = { "detect", "halt", "probe", "backup", "erase", "program", "verify" };
+
+void cost_report(void)
+{
+    struct jtag_cost *c;
+    double seconds;
+    int i;
+
+    cost_enter(cost_phase);
+
+    printf("\nJTAG cost by phase:\n");
+    printf("    %-8s %12s %9s %9s %9s %9s %9s %9s %9s %8s %10s\n",
+           "phase", "TCK", "IR scans", "DR scans", "IR kept", "DMA retry", "PrAcc", "polls", "bytes", "seconds", "bytes/s");
+    for (i = 0; i < PHASES; i++)
+    {
+        c = &cost[i];
+        if (!c->tck) continue;
+
+        seconds = c->ns / 1e9;
+        printf("    %-8s %12llu %9llu %9llu %9llu %9llu %9llu %9llu %9llu %8.2f",
+               phase_name[i], c->tck, c->ir_scans, c->dr_scans, c->ir_cached, c->dma_retries, c->pracc, c->polls, c->bytes, seconds);
+        if (c->bytes && seconds > 0) printf(" %10.0f\n", c->bytes / seconds);
+        else                         printf(" %10s\n", "-");
+    }
+}
+
+
+// Progress line of the long loops.  Loops report how far they got as
+// often as they like; the line is redrawn at most progress_hz times a
+// second, so reporting costs them a clock read.
+static unsigned long long progress_begin, progress_shown;
+static unsigned int progress_total;
+
+static void progress_draw(unsigned int done, unsigned long long now)
+{
+    double rate = done / ((now - progress_begin) / 1e9 + 1e-9);
+    unsigned int eta = (rate > 0) ? (progress_total - done) / rate : 0;
+
+    printf("\r    %3u%%  %u of %u bytes  %.1f KB/s  ETA %u:%02u:%02u ",
+           progress_total ? (unsigned int)(done * 100ULL / progress_total) : 100, done, progress_total,
+           rate / 1024, eta / 3600, eta / 60 % 60, eta % 60);
+    fflush(stdout);
+}
+
+void progress_start(unsigned int total)
+{
+    progress_total = total;
+    progress_begin = clock_ns();
+    progress_shown = progress_begin;
+}
+
+void progress_update(unsigned int done)
+{
+    unsigned long long now;
+
+    if (silent_mode || !progress_hz || hexdump) return;
+
+    now = clock_ns();
+    if (now - progress_shown < 1000000000ULL / progress_hz) return;
+    progress_shown = now;
+
+    progress_draw(done, now);
+}
+
+void progress_end(void)
+{
+    if (silent_mode || !progress_hz || hexdump) return;
+
+    progress_draw(progress_total, clock_ns());
+    printf("\n");
+}
+
+
+// /report: every step of the run, timed on the monotonic clock, goes into
+// a JSON document written at shutdown
+void report_step(const char *name, unsigned int addr, unsigned int bytes, unsigned long long start)
+{
+    struct report_step *r;
+
+    if (report_name == NULL) return;
+
+    if (report_count == report_alloc)
+    {
+        report_alloc = report_alloc ? 2 * report_alloc : 64;
+        report_steps = realloc(report_steps, report_alloc * sizeof(*report_steps));
+        if (report_steps == NULL)
+        {
+            perror("Failed to grow the report");
+            exit(1);
+        }
+    }
+
+    r = &report_steps[report_count++];
+    r->name  = name;
+    r->addr  = addr;
+    r->bytes = bytes;
+    r->ns    = clock_ns() - start;
+}
+
+static void report_string(FILE *fd, const char *str)
+{
+    fputc('"', fd);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\') fputc('\\', fd);
+        if ((unsigned char)*str >= ' ') fputc(*str, fd);
+    }
+    fputc('"', fd);
+}
+
+static void report_rate(FILE *fd, unsigned long long bytes, unsigned long long ns)
+{
+    if (bytes) fprintf(fd, ", \"bytes\": %llu, \"bytes_per_s\": %.0f", bytes, ns ? bytes * 1e9 / ns : 0.0);
+}
+
+void report_write(void)
+{
+    struct report_step *r;
+    struct jtag_cost *c;
+    unsigned long long ns, bytes;
+    int i, j, blocks, first;
+    FILE *fd;
+
+    if (report_name == NULL) return;
+
+    fd = fopen(report_name, "w");
+    if (fd == NULL)
+    {
+        fprintf(stderr,"Could not open %s for writing\n", report_name);
+        return;
+    }
+
+    fprintf(fd, "{\n  \"area\": ");
+    report_string(fd, AREA_NAME);
+    fprintf(fd, ",\n  \"cpu_id\": \"0x%08x\",\n  \"flash\": ", proc_id);
+    report_string(fd, flash_part);
+    fprintf(fd, ",\n  \"flash_size\": %u,\n  \"dma\": %s,\n  \"delay\": %u,\n  \"total_ns\": %llu,\n",
+            flash_size, USE_DMA ? "true" : "false", delay, clock_ns() - report_start);
+
+    // Every step as it happened
+    fprintf(fd, "  \"steps\": [");
+    for (i = 0; i < report_count; i++)
+    {
+        r = &report_steps[i];
+        fprintf(fd, "%s\n    { \"step\": ", i ? "," : "");
+        report_string(fd, r->name);
+        if (r->bytes) fprintf(fd, ", \"addr\": \"0x%08x\"", r->addr);
+        fprintf(fd, ", \"ns\": %llu", r->ns);
+        report_rate(fd, r->bytes, r->ns);
+        fprintf(fd, " }");
+    }
+
+    // The same added up per step name, in order of first appearance
+    fprintf(fd, "\n  ],\n  \"totals\": {");
+    first = 1;
+    for (i = 0; i < report_count; i++)
+    {
+        for (j = 0; j < i; j++)
+            if (strcmp(report_steps[j].name, report_steps[i].name) == 0) break;
+        if (j < i) continue;
+
+        ns = bytes = 0;
+        blocks = 0;
+        for (j = i; j < report_count; j++)
+        {
+            if (strcmp(report_steps[j].name, report_steps[i].name)) continue;
+            ns    += report_steps[j].ns;
+            bytes += report_steps[j].bytes;
+            blocks++;
+        }
+
+        fprintf(fd, "%s\n    ", first ? "" : ",");
+        report_string(fd, report_steps[i].name);
+        fprintf(fd, ": { \"count\": %d, \"ns\": %llu", blocks, ns);
+        report_rate(fd, bytes, ns);
+        fprintf(fd, " }");
+        first = 0;
+    }
+
+    // What each phase cost on the wire, as in cost_report()
+    fprintf(fd, "\n  },\n  \"jtag\": {");
+    first = 1;
+    for (i = 0; i < PHASES; i++)
+    {
+        c = &cost[i];
+        if (!c->tck) continue;
+
+        fprintf(fd, "%s\n    \"%s\": { \"tck\": %llu, \"ir_scans\": %llu, \"dr_scans\": %llu, \"ir_cached\": %llu, "
+                "\"dma_retries\": %llu, \"pracc\": %llu, \"polls\": %llu, \"ns\": %llu",
+                first ? "" : ",", phase_name[i], c->tck, c->ir_scans, c->dr_scans, c->ir_cached,
+                c->dma_retries, c->pracc, c->polls, c->ns);
+        report_rate(fd, c->bytes, c->ns);
+        fprintf(fd, " }");
+        first = 0;
+    }
+    fprintf(fd, "\n  }\n}\n");
+
+    fclose(fd);
+    printf("Timing report written to %s\n", report_name);
+}
+
+// /trace: log every IR and DR scan with what came back, for -replay
+void trace_open(char *filename)
+{
+    trace_file = fopen(filename, "wb");
+    if (trace_file == NULL)
+    {
+        fprintf(stderr,"Could not open %s for writing\n", filename);
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, trace_file);
+}
+
+void trace_close(void)
+{
+    if (trace_file == NULL) return;
+
+    fclose(trace_file);
+    trace_file = NULL;
+    printf("JTAG trace written to %s\n", trace_name);
+}
+
+// /vcd: a Value Change Dump of TCK, TMS, TDI and TDO for GTKWave, in ns
+// since the file was opened
+void vcd_open(char *filename)
+{
+    static const char *pin[4] = { "TCK", "TMS", "TDI", "TDO" };
+    int i;
+
+    vcd_file = fopen(filename, "w");
+    if (vcd_file == NULL)
+    {
+        fprintf(stderr,"Could not open %s for writing\n", filename);
+        exit(1);
+    }
+
+    fprintf(vcd_file, "$version tjtag $end\n$timescale 1ns $end\n$scope module jtag $end\n");
+    for (i = 0; i < 4; i++)
+        fprintf(vcd_file, "$var wire 1 %c %s $end\n", '!' + i, pin[i]);
+    fprintf(vcd_file, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars 0! 0\" 0# 0$ $end\n");
+
+    vcd_start = clock_ns();
+
+#ifndef WINDOWS_VERSION
+    vcd_running = 1;
+    if (pthread_create(&vcd_thread, NULL, vcd_writer, NULL))
+    {
+        vcd_running = 0;
+        printf("*** No /vcd writer thread, writing edges between scans ***\n\n");
+    }
+#endif
+}
+
+void vcd_close(void)
+{
+    if (vcd_file == NULL) return;
+
+#ifndef WINDOWS_VERSION
+    if (vcd_running)
+    {
+        VCD_STORE(vcd_running, 0);
+        pthread_join(vcd_thread, NULL);
+    }
+#endif
+
+    vcd_flush();
+    fclose(vcd_file);
+    vcd_file = NULL;
+    printf("JTAG waveform written to %s\n", vcd_name);
+}
+
+// Write out the edges in the ring, returns how many were taken.  Whatever
+// the ring lost to a single scan longer than it is shows up as a comment
+// and a gap.
+static int vcd_flush(void)
+{
+    struct vcd_event e;
+    unsigned long head, tail = vcd_tail;
+    unsigned int lines, changed;
+    int i, taken = 0;
+
+    while (tail != (head = VCD_LOAD(vcd_head)))
+    {
+        if (head - tail > VCD_RING)
+        {
+            fprintf(vcd_file, "$comment %lu edges lost $end\n", head - tail - VCD_RING);
+            tail = head - VCD_RING;
+        }
+
+        // The kernel may have lapped this slot while it was being copied
+        e = vcd_ring[tail & (VCD_RING - 1)];
+        if (VCD_LOAD(vcd_head) - tail > VCD_RING)
+            continue;
+        VCD_STORE(vcd_tail, ++tail);
+        taken++;
+
+        lines = e.lines;
+        if (!(lines & VCD_SAMPLED)) lines = (lines & ~VCD_TDO) | (vcd_lines & VCD_TDO);
+        changed = (lines ^ vcd_lines) & (VCD_TCK | VCD_TMS | VCD_TDI | VCD_TDO);
+        if (!changed) continue;
+
+        // Timestamps have to go up, the clock may repeat one across two edges
+        if (e.ns - vcd_start > vcd_time)
+        {
+            vcd_time = e.ns - vcd_start;
+            fprintf(vcd_file, "#%llu\n", vcd_time);
+        }
+        for (i = 0; i < 4; i++)
+            if (changed & (1 << i)) fprintf(vcd_file, "%u%c\n", (lines >> i) & 1, '!' + i);
+        vcd_lines = lines;
+    }
+
+    return taken;
+}
+
+#ifndef WINDOWS_VERSION
+static void *vcd_writer(void *arg)
+{
+    while (VCD_LOAD(vcd_running))
+        if (!vcd_flush()) usleep(1000);
+    return NULL;
+}
+#endif
+
+// The writer is half a ring behind: give it the time to catch up before the
+// next scan rather than lose edges.  Without a writer, write them out here.
+static void vcd_wait(void)
+{
+#ifndef WINDOWS_VERSION
+    if (vcd_running)
+    {
+        while (vcd_head - VCD_LOAD(vcd_tail) >= VCD_RING / 4)
+            usleep(100);
+        return;
+    }
+#endif
+    vcd_flush();
+}
+
+// Somewhere for TDO to go when the caller of shift_bits() does not want it
+static unsigned char *trace_tdo(int nbits)
+{
+    static unsigned char *buf = NULL;
+    static int size = 0;
+
+    if (SCAN_BYTES(nbits) > size)
+    {
+        size = SCAN_BYTES(nbits);
+        buf = realloc(buf, size);
+        if (buf == NULL)
+        {
+            perror("Failed to grow the trace buffer");
+            exit(1);
+        }
+    }
+    return buf;
+}
+
+static void trace_shift(const unsigned char *tms_vec, const unsigned char *tdi_vec, const unsigned char *tdo_vec,
+                        int nbits, unsigned long long start, unsigned long long end)
+{
+    unsigned char head[TRACE_HEAD], last;
+    unsigned long long gap = trace_mark ? start - trace_mark : 0;
+    unsigned long long took = end - start;
+    int bytes = SCAN_BYTES(nbits);
+
+    if (gap > 0xFFFFFFFF)  gap = 0xFFFFFFFF;
+    if (took > 0xFFFFFFFF) took = 0xFFFFFFFF;
+    trace_mark = end;
+
+    head[0] = (tap_state == TAP_DRSHIFT) ? TRACE_DR : (tap_state == TAP_IRSHIFT) ? TRACE_IR : TRACE_TMS;
+    scan_put_word(head + 1, nbits);
+    scan_put_word(head + 5, (unsigned int)gap);
+    scan_put_word(head + 9, (unsigned int)took);
+    fwrite(head, 1, sizeof(head), trace_file);
+    if (!bytes) return;
+
+    fwrite(tms_vec, 1, bytes, trace_file);
+    fwrite(tdi_vec, 1, bytes, trace_file);
+
+    // Cables leave whatever they like past the last bit
+    last = tdo_vec[bytes - 1];
+    if (nbits & 7) last &= (1 << (nbits & 7)) - 1;
+    fwrite(tdo_vec, 1, bytes - 1, trace_file);
+    fwrite(&last, 1, 1, trace_file);
+}
+
+
 void unlock_bypass(void)
 {
     ejtag_write_h(FLASH_MEMORY_START + (0x555 << 1), 0x00900090 ); /* unlock bypass reset */
     ejtag_write_h(FLASH_MEMORY_START + (0x555 << 1), 0x00aa00aa ); /* unlock bypass */
     ejtag_write_h(FLASH_MEMORY_START + (0x2aa << 1), 0x00550055 );
     ejtag_write_h(FLASH_MEMORY_START + (0x555 << 1), 0x00200020 );
+    bypass_mode = 1;
     printf("\nEntered Unlock Bypass mode->\n");
 }
 
@@ -1383,18 +2760,51 @@ void unlock_bypass_reset(void)
 {
     ejtag_write_h(FLASH_MEMORY_START + (0x555 << 1), 0x00900090 ); /* unlock bypass reset */
     ejtag_write_h(FLASH_MEMORY_START + (0x000), 0x00000000 );
+    bypass_mode = 0;
+}
+
+// byteSwap_32 over a whole buffer, a loop the compiler turns into vector code
+void swap_words(unsigned int *buf, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        buf[i] = byteSwap_32(buf[i]);
+}
+
+// Console side of a backup: the words from..to-1 of image, just read
+static void backup_show(unsigned int start, unsigned int length, const unsigned int *image, unsigned int from, unsigned int to)
+{
+    unsigned int i, addr;
+
+    if (!hexdump)
+    {
+        progress_update(to * 4);
+        return;
+    }
+
+    for (i = from; i < to; i++)
+    {
+        addr = start + 4 * i;
+        if ((addr&0xF) == 0)  printf("[%3d%% Backed Up]   %08x: ", (int)((i + 1) * 400ULL / length), addr);
+        printf("%08x%c", image[i], (addr&0xF)==0xC?'\n':' ');
+    }
+    fflush(stdout);
 }
 
 void run_backup(char *filename, unsigned int start, unsigned int length)
 {
-    unsigned int addr, data;
+    unsigned int *image = NULL;
+    unsigned int done, words, total;
+    size_t bytes;
+    int mapped = 0;
     FILE *fd;
-    int counter = 0;
-    int percent_complete = 0;
     char newfilename[128] = "";
+    char partfilename[136];
+    int failed = 0;
 //    int swp_endian = (cmd_type == CMD_TYPE_SPI);
     time_t start_time = time(0);
-    time_t end_time, elapsed_seconds;
+    unsigned long long start_ns = clock_ns();
 
     struct tm* lt = localtime(&start_time);
     char time_str[16];
@@ -1414,58 +2824,100 @@ void run_backup(char *filename, unsigned int start, unsigned int length)
         strcat(newfilename,time_str);
     }
 
-    fd = fopen(newfilename, "wb" );
+    // Until it is complete the backup only exists under a .part name, so a
+    // run that dies half way never leaves a file that looks finished
+    sprintf(partfilename, "%s.part", newfilename);
+    fd = fopen(partfilename, "wb+" );
     if (fd<=0)
     {
-        fprintf(stderr,"Could not open %s for writing\n", newfilename);
+        fprintf(stderr,"Could not open %s for writing\n", partfilename);
         exit(1);
     }
 
+    total = (length + 3) / 4;
+    bytes = (size_t)total * 4;
+
+    // The words land straight in the output file where it can be mapped,
+    // otherwise in one buffer that is written out at the end.  The space is
+    // reserved up front, a full disk would otherwise only show as a SIGBUS.
+#ifndef WINDOWS_VERSION
+    if (bytes && posix_fallocate(fileno(fd), 0, bytes) == 0)
+    {
+        image = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fd), 0);
+        if (image == MAP_FAILED) image = NULL;
+        else                     mapped = 1;
+    }
+#endif
+    if (image == NULL)
+    {
+        image = malloc(bytes + 4);
+        if (image == NULL)
+        {
+            fprintf(stderr,"Could not allocate %u bytes for the backup\n", (unsigned int)bytes);
+            exit(1);
+        }
+    }
+
     printf("=========================\n");
     printf("Backup Routine Started\n");
     printf("=========================\n");
 
     printf("\nSaving %s to Disk...\n",newfilename);
-    for (addr=start; addr<(start+length); addr+=4)
+    cost_enter(PHASE_BACKUP);
+    progress_start(bytes);
+    for (done = 0; done < total; done += words)
     {
-        counter += 4;
-        percent_complete = (counter * 100 / length);
-        if (!silent_mode)
-            if ((addr&0xF) == 0)  printf("[%3d%% Backed Up]   %08x: ", percent_complete, addr);
-
-        data = ejtag_read(addr);
-
-
-        if (swap_endian) data = byteSwap_32(data);
-        fwrite( (unsigned char*) &data, 1, sizeof(data), fd);
+        words = total - done;
+        if (words > BURST_WORDS) words = BURST_WORDS;
 
-        if (silent_mode)  printf("%4d%%   bytes = %d\r", percent_complete, counter);
-        else              printf("%08x%c", data, (addr&0xF)==0xC?'\n':' ');
+        ejtag_read_block(start + 4 * done, image + done, words);
+        if (swap_endian) swap_words(image + done, words);
 
-        fflush(stdout);
+        backup_show(start, length, image, done, done + words);
     }
+    progress_end();
 
+    cost[PHASE_BACKUP].bytes += bytes;
+#ifndef WINDOWS_VERSION
+    if (mapped)
+    {
+        failed = (msync(image, bytes, MS_SYNC) != 0);
+        munmap(image, bytes);
+    }
+    else
+#endif
+    {
+        failed = (fwrite(image, 1, bytes, fd) != bytes);
+        free(image);
+    }
+    if (fclose(fd) != 0) failed = 1;
 
-
-    fclose(fd);
+#ifdef WINDOWS_VERSION   // ---- Compiler Specific Code ----
+    if (!failed) remove(newfilename);
+#endif
+    if (failed || rename(partfilename, newfilename) != 0)
+    {
+        fprintf(stderr,"Could not write %s: %s\n", newfilename, strerror(errno));
+        remove(partfilename);
+        chip_shutdown();
+        exit(1);
+    }
 
     printf("Done  (%s saved to Disk OK)\n\n",newfilename);
 
-    printf("bytes written: %d\n", counter);
+    printf("bytes written: %u\n", (unsigned int)bytes);
 
     printf("=========================\n");
     printf("Backup Routine Complete\n");
     printf("=========================\n");
 
-    time(&end_time);
-    elapsed_seconds = difftime(end_time, start_time);
-    printf("elapsed time: %d seconds\n", (int)elapsed_seconds);
+    report_step("backup", start, length, start_ns);
+    printf("elapsed time: %.3f seconds\n", (clock_ns() - start_ns) / 1e9);
 }
 
 void run_erase(char *filename, unsigned int start, unsigned int length)
 {
-    time_t start_time = time(0);
-    time_t end_time, elapsed_seconds;
+    unsigned long long start_ns = clock_ns();
 
     printf("*** You Selected to Erase the %s ***\n\n",filename);
 
@@ -1480,9 +2932,7 @@ void run_erase(char *filename, unsigned int start, unsigned int length)
     printf("Erasing Routine Complete\n");
     printf("=========================\n");
 
-    time(&end_time);
-    elapsed_seconds = difftime(end_time, start_time);
-    printf("elapsed time: %d seconds\n", (int)elapsed_seconds);
+    printf("elapsed time: %.3f seconds\n", (clock_ns() - start_ns) / 1e9);
 }
 
 
@@ -1496,6 +2946,8 @@ void identify_flash_part(void)
     block_total = 0;
     flash_size  = 0;
     cmd_type    = 0;
+    write_buffer = 0;
+    flash_flags  = 0;
     strcpy(flash_part,"");
 
     /*     Spansion ID workaround (kb1klk) 30 Dec 2007
@@ -1535,6 +2987,8 @@ void identify_flash_part(void)
             flash_size = flash_chip->flash_size;
             cmd_type   = flash_chip->cmd_type;
             strcpy(flash_part, flash_chip->flash_part);
+            if (!force_nobuffer) write_buffer = flash_chip->write_buffer;
+            flash_flags = flash_chip->flags;
 
             if (strcasecmp(AREA_NAME,"CUSTOM")==0)
             {
@@ -1630,6 +3084,12 @@ void identify_flash_part(void)
             if (flash_chip->region3_num)  define_block(flash_chip->region3_num, flash_chip->region3_size);
             if (flash_chip->region4_num)  define_block(flash_chip->region4_num, flash_chip->region4_size);
 
+            // Intel parts the table has no write buffer for may still report one through CFI
+            if (!write_buffer && !force_nobuffer && ((cmd_type == CMD_TYPE_BSC) || (cmd_type == CMD_TYPE_SCS)))
+                write_buffer = sflash_cfi_buffer();
+            if (write_buffer > WRITE_BUFFER_MAX) write_buffer = WRITE_BUFFER_MAX;
+            if (write_buffer < 4) write_buffer = 0;
+
             sflash_reset();
 
             printf("Done\n\n");
@@ -1644,6 +3104,8 @@ void identify_flash_part(void)
 
             printf("    - Flash Chip Window Start .... : %08x\n", FLASH_MEMORY_START);
             printf("    - Flash Chip Window Length ... : %08x\n", flash_size);
+            if (write_buffer)
+                printf("    - Write Buffer Size .......... : %d bytes\n", write_buffer);
             printf("    - Selected Area Start ........ : %08x\n", AREA_START);
             printf("    - Selected Area Length ....... : %08x\n\n", AREA_LENGTH);
 
@@ -1669,6 +3131,16 @@ void define_block(unsigned int block_count, unsigned int block_size)
     }
 }
 
+// End of the flash block addr is in
+unsigned int flash_block_end(unsigned int addr)
+{
+    int i;
+
+    for (i = 1; i <= block_total; i++)
+        if (blocks[i] > addr) return blocks[i];
+    return FLASH_MEMORY_START + flash_size;
+}
+
 
 void sflash_config(void)
 {
@@ -1909,6 +3381,8 @@ uint32_t spiflash_sendcmd(int op)
     uint32_t reg, mask;
     struct opcodes *ptr_opcode;
 
+    USDT1(spiflash_sendcmd__entry, op);
+
     ptr_opcode = &stm_opcodes[op];
 
     if (bcmproc)
@@ -1919,7 +3393,7 @@ uint32_t spiflash_sendcmd(int op)
     do
     {
         reg = spiflash_regread32(spi_flash_ctl);
-
+        cost[cost_phase].polls++;
     }
     while (reg & spi_ctl_busy);
 
@@ -1945,7 +3419,7 @@ uint32_t spiflash_sendcmd(int op)
     do
     {
         reg = spiflash_regread32(spi_flash_ctl);
-
+        cost[cost_phase].polls++;
     }
     while (reg & spi_ctl_busy);
 
@@ -1975,6 +3449,7 @@ uint32_t spiflash_sendcmd(int op)
         reg = 0;
     }
 
+    USDT1(spiflash_sendcmd__return, reg);
     return reg;
 }
 
@@ -2017,7 +3492,7 @@ static int spiflash_erase_block( uint32_t addr )
     do
     {
         reg = spiflash_regread32(spi_flash_ctl);
-
+        cost[cost_phase].polls++;
     }
     while (reg & spi_ctl_busy);
 
@@ -2045,7 +3520,7 @@ static int spiflash_erase_block( uint32_t addr )
     do
     {
         reg = spiflash_regread32(spi_flash_ctl);
-
+        cost[cost_phase].polls++;
     }
     while (reg & spi_ctl_busy);
 
@@ -2081,7 +3556,7 @@ void spiflash_write_word(uint32_t addr, uint32_t data)
     do
     {
         reg = spiflash_regread32(spi_flash_ctl);
-
+        cost[cost_phase].polls++;
     }
     while (reg & spi_ctl_busy);
 
@@ -2106,115 +3581,351 @@ void spiflash_write_word(uint32_t addr, uint32_t data)
     if (Flash_DEBUG)
         printf("spi_flash_ctl 0x%08x reg 0x%08x\n", spi_flash_ctl, reg);
 
-    finished = 0;
+    finished = 0;
+
+    /* wait CPU spi activity */
+    do
+    {
+        reg = spiflash_regread32(spi_flash_ctl);
+        cost[cost_phase].polls++;
+    }
+    while (reg & spi_ctl_busy);
+
+    do
+    {
+        if (bcmproc)
+            reg = spiflash_sendcmd(BCM_SPI_RD_STATUS);
+        else
+            reg = spiflash_sendcmd(SPI_RD_STATUS);
+
+        if (!(reg & SPI_STATUS_WIP))
+        {
+            finished = TRUE;
+        }
+    }
+    while (!finished);
+}
+
+
+void run_flash(char *filename, unsigned int start, unsigned int length)
+{
+    unsigned int addr, data ;
+    unsigned int chunk[WRITE_BUFFER_MAX / 4];
+    unsigned int chunk_addr = 0, words = 0, i;
+    int buffered, failed = 0;
+    FILE *fd ;
+    int counter = 0;
+    int percent_complete = 0;
+    unsigned long long start_ns = clock_ns();
+    unsigned long long step = 0;
+    unsigned int step_addr = start, step_end = start;
+
+    printf("*** You Selected to Flash the %s ***\n\n",filename);
+
+    fd=fopen(filename, "rb" );
+    if (fd<=0)
+    {
+        fprintf(stderr,"Could not open %s for reading\n", filename);
+        exit(1);
+    }
+
+    printf("=========================\n");
+    printf("Flashing Routine Started\n");
+    printf("=========================\n");
+
+    if (issue_erase) sflash_erase_area(start,length);
+
+    // Write-to-Buffer where the chip has one and nothing calls for the old ways
+    buffered = write_buffer && ((cmd_type == CMD_TYPE_BSC) || (cmd_type == CMD_TYPE_SCS) ||
+               ((cmd_type == CMD_TYPE_AMD) && !bypass && !speedtouch && (proc_id != 0x00000001)));
+
+    // Otherwise Unlock Bypass, when asked for or known to work and there is more than a word to program
+    if ((cmd_type == CMD_TYPE_AMD) && !buffered && !speedtouch && !force_nobypass &&
+        (bypass || ((flash_flags & FLASH_F_BYPASS) && (length > 4))))
+    {
+        unlock_bypass();
+    }
+
+    printf("\nLoading %s to Flash Memory...\n",filename);
+    cost_enter(PHASE_PROGRAM);
+    progress_start(length);
+    for (addr=start; addr<(start+length); addr+=4)
+    {
+        // One report step per flash block
+        if (addr >= step_end)
+        {
+            if (addr != start)
+            {
+                if (buffered && sflash_buffer_check(step_addr)) failed++;
+                report_step("program", step_addr, addr - step_addr, step);
+            }
+            step_addr = addr;
+            step_end  = flash_block_end(addr);
+            step      = clock_ns();
+        }
+
+        counter += 4;
+        percent_complete = (counter * 100 / length);
+        if (hexdump)
+            if ((addr&0xF) == 0)  printf("[%3d%% Flashed]   %08x: ", percent_complete, addr);
+
+        if (buffered)
+        {
+            // Program a whole write buffer page, or what is left of it, at once
+            if (addr >= chunk_addr + words * 4)
+            {
+                chunk_addr = addr;
+                words = (write_buffer - (addr % write_buffer)) / 4;
+                if (words > (start + length - addr + 3) / 4) words = (start + length - addr + 3) / 4;
+
+                for (i = 0; i < words; i++) chunk[i] = 0xFFFFFFFF;
+                fread( (unsigned char*) chunk, 4, words, fd);
+
+                // Same as below, a page left all 0xFF's by erasing needs no writing
+                for (i = 0; i < words; i++)
+                    if (chunk[i] != 0xFFFFFFFF) break;
+                if (!issue_erase || (i < words))
+                    sflash_write_buffer(chunk_addr, chunk, words);
+            }
+            data = chunk[(addr - chunk_addr) / 4];
+        }
+        else
+        {
+            fread( (unsigned char*) &data, 1,sizeof(data), fd);
+
+            // Erasing Flash Sets addresses to 0xFF's so we can avoid writing these (for speed)
+            if (issue_erase)
+            {
+                if (!(data == 0xFFFFFFFF))
+                    sflash_write_word(addr, data);
+            }
+            else
+                sflash_write_word(addr, data);  // Otherwise we gotta flash it all
+        }
+
+
+        if (hexdump)
+        {
+            printf("%08x%c", data, (addr&0xF)==0xC?'\n':' ');
+            fflush(stdout);
+        }
+        else progress_update(counter);
+
+        data = 0xFFFFFFFF;  // This is in case file is shorter than expected length
+    }
+
+    if (buffered && sflash_buffer_check(step_addr)) failed++;
+    if (bypass_mode) unlock_bypass_reset();
+    progress_end();
+    report_step("program", step_addr, start + length - step_addr, step);
+    cost[PHASE_PROGRAM].bytes += counter;
+    fclose(fd);
+    if (failed)
+    {
+        printf("*** %s loaded into Flash Memory, but %d block%s failed to program ***\n\n",
+               filename, failed, (failed > 1) ? "s" : "");
+        run_failed = 1;
+    }
+    else if (failed_words)
+    {
+        printf("*** %s loaded into Flash Memory, but %d word%s failed to program ***\n\n",
+               filename, failed_words, (failed_words > 1) ? "s" : "");
+        run_failed = 1;
+    }
+    else
+        printf("Done  (%s loaded into Flash Memory OK)\n\n",filename);
+
+    sflash_reset();
+
+    if (issue_verify) run_verify(filename, start, length);
+
 
-    /* wait CPU spi activity */
-    do
-    {
-        reg = spiflash_regread32(spi_flash_ctl);
+    printf("=========================\n");
+    printf("Flashing Routine Complete\n");
+    printf("=========================\n");
 
+    printf("elapsed time: %.3f seconds\n", (clock_ns() - start_ns) / 1e9);
+}
+
+// Read the flashed range back and compare it with the file it came from
+void run_verify(char *filename, unsigned int start, unsigned int length)
+{
+    unsigned int addr, data;
+    unsigned int buf[BURST_WORDS];
+    unsigned int burst, words;
+    unsigned int errors = 0;
+    unsigned long long step = 0;
+    unsigned int step_addr = start, step_end = start;
+    FILE *fd;
 
+    fd = fopen(filename, "rb");
+    if (fd == NULL)
+    {
+        fprintf(stderr,"Could not open %s for reading\n", filename);
+        return;
     }
-    while (reg & spi_ctl_busy);
 
-    do
+    printf("Verifying %s against Flash Memory...\n", filename);
+    cost_enter(PHASE_VERIFY);
+    progress_start(length);
+
+    for (addr=start; addr<(start+length); addr+=4)
     {
-        if (bcmproc)
-            reg = spiflash_sendcmd(BCM_SPI_RD_STATUS);
-        else
-            reg = spiflash_sendcmd(SPI_RD_STATUS);
+        if (addr >= step_end)
+        {
+            if (addr != start) report_step("verify", step_addr, addr - step_addr, step);
+            step_addr = addr;
+            step_end  = flash_block_end(addr);
+            step      = clock_ns();
+        }
 
-        if (!(reg & SPI_STATUS_WIP))
+        burst = ((addr - start) / 4) % BURST_WORDS;
+        if (burst == 0)
         {
-            finished = TRUE;
+            words = (start + length - addr + 3) / 4;
+            if (words > BURST_WORDS) words = BURST_WORDS;
+            ejtag_read_block(addr, buf, words);
+            progress_update(addr - start);
+        }
+
+        data = 0xFFFFFFFF;  // Past the end of the file there is only what erasing left
+        if (fread((unsigned char*) &data, 1, sizeof(data), fd) == 0 && !issue_erase)
+            continue;
+
+        if (buf[burst] != data)
+        {
+            if (errors < 16) printf("\r    %08x: %08x, expected %08x%24s\n", addr, buf[burst], data, "");
+            errors++;
         }
     }
-    while (!finished);
+    progress_end();
+    report_step("verify", step_addr, start + length - step_addr, step);
+    cost[PHASE_VERIFY].bytes += length;
+    fclose(fd);
+
+    if (errors) printf("*** %u words differ ***\n\n", errors);
+    else        printf("Done  (contents match)\n\n");
 }
 
+static void replay_show(const unsigned char *vec, int bytes)
+{
+    // Long idle runs only show their first MAX_SCAN_BITS
+    if (bytes > SCAN_BYTES(MAX_SCAN_BITS))
+    {
+        bytes = SCAN_BYTES(MAX_SCAN_BITS);
+        printf("...");
+    }
+    while (bytes--) printf("%02x", vec[bytes]);
+}
 
-void run_flash(char *filename, unsigned int start, unsigned int length)
+// -replay: shift the scans of a /trace file again through this cable and
+// compare what comes back, and how long it takes, with the recording
+void run_replay(char *filename)
 {
-    unsigned int addr, data ;
-    FILE *fd ;
-    int counter = 0;
-    int percent_complete = 0;
-    time_t start_time = time(0);
-    time_t end_time, elapsed_seconds;
+    static const char *kind_name[TRACE_KINDS] = { "DR", "IR", "TMS" };
+    unsigned char head[TRACE_HEAD];
+    unsigned char *tms_vec = NULL, *tdi_vec = NULL, *tdo_vec = NULL, *out_vec = NULL;
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    unsigned long long recorded[TRACE_KINDS] = { 0 }, replayed[TRACE_KINDS] = { 0 }, gaps = 0;
+    unsigned long scans[TRACE_KINDS] = { 0 };
+    unsigned long total = 0, mismatches = 0;
+    unsigned long long start;
+    int kind, nbits, bytes, damaged, size = 0;
+    FILE *fd;
 
-    printf("*** You Selected to Flash the %s ***\n\n",filename);
+    printf("*** You Selected to Replay %s ***\n\n", filename);
 
-    fd=fopen(filename, "rb" );
-    if (fd<=0)
+    fd = fopen(filename, "rb");
+    if (fd == NULL)
     {
         fprintf(stderr,"Could not open %s for reading\n", filename);
         exit(1);
     }
-
-    printf("=========================\n");
-    printf("Flashing Routine Started\n");
-    printf("=========================\n");
-
-    if (issue_erase) sflash_erase_area(start,length);
-
-    if (bypass)
+    if (fread(magic, 1, sizeof(magic), fd) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)))
     {
-        unlock_bypass();
+        fprintf(stderr,"%s is not a tjtag trace\n", filename);
+        exit(1);
     }
 
-    printf("\nLoading %s to Flash Memory...\n",filename);
-    for (addr=start; addr<(start+length); addr+=4)
-    {
-        counter += 4;
-        percent_complete = (counter * 100 / length);
-        if (!silent_mode)
-            if ((addr&0xF) == 0)  printf("[%3d%% Flashed]   %08x: ", percent_complete, addr);
-
-        fread( (unsigned char*) &data, 1,sizeof(data), fd);
+    lpt_openport();
+    if (tck_khz) tck_calibrate();
 
-        // Erasing Flash Sets addresses to 0xFF's so we can avoid writing these (for speed)
-        if (issue_erase)
+    while (fread(head, 1, sizeof(head), fd) == sizeof(head))
+    {
+        kind  = head[0];
+        nbits = scan_get_word(head + 1);
+        bytes = SCAN_BYTES(nbits);
+        damaged = (kind >= TRACE_KINDS) || (nbits <= 0) || (nbits > TRACE_MAX_BITS);
+        if (!damaged && bytes > size)
         {
-            if (!(data == 0xFFFFFFFF))
-                sflash_write_word(addr, data);
+            size = bytes;
+            tms_vec = realloc(tms_vec, 4 * size);
+            if (tms_vec == NULL)
+            {
+                perror("Failed to grow the replay buffer");
+                exit(1);
+            }
+            tdi_vec = tms_vec + size;
+            tdo_vec = tdi_vec + size;
+            out_vec = tdo_vec + size;
         }
-        else
-            sflash_write_word(addr, data);  // Otherwise we gotta flash it all
-
 
-        // original  if (silent_mode)  printf("%4d%%   bytes = %d\r", percent_complete, counter);
-        if (silent_mode)  printf("%4d%%   bytes = %d (%08x)@(%08x)=%08x\r", percent_complete, counter, counter, addr, data);
-        else              printf("%08x%c", data, (addr&0xF)==0xC?'\n':' ');
+        if (damaged || (fread(tms_vec, 1, bytes, fd) != bytes) ||
+            (fread(tdi_vec, 1, bytes, fd) != bytes) || (fread(tdo_vec, 1, bytes, fd) != bytes))
+        {
+            printf("*** %s is damaged after %lu scans ***\n", filename, total);
+            break;
+        }
 
+        start = clock_ns();
+        shift_bits(tms_vec, tdi_vec, out_vec, nbits);
+        replayed[kind] += clock_ns() - start;
+        recorded[kind] += scan_get_word(head + 9);
+        gaps += scan_get_word(head + 5);
+        scans[kind]++;
+        total++;
 
-        fflush(stdout);
-        data = 0xFFFFFFFF;  // This is in case file is shorter than expected length
+        if (nbits & 7) out_vec[bytes - 1] &= (1 << (nbits & 7)) - 1;
+        if (memcmp(out_vec, tdo_vec, bytes))
+        {
+            if (mismatches < 16)
+            {
+                printf("scan %lu: %s %d bits, TDO ", total - 1, kind_name[kind], nbits);
+                replay_show(out_vec, bytes);
+                printf(", recorded ");
+                replay_show(tdo_vec, bytes);
+                printf("\n");
+            }
+            mismatches++;
+        }
     }
-
     fclose(fd);
-    printf("Done  (%s loaded into Flash Memory OK)\n\n",filename);
-
-    sflash_reset();
+    free(tms_vec);
 
+    // The raw shifts went round the TAP model
+    tap_state = TAP_UNKNOWN;
 
-    printf("=========================\n");
-    printf("Flashing Routine Complete\n");
-    printf("=========================\n");
-
-    time(&end_time);
-    elapsed_seconds = difftime(end_time, start_time);
-    printf("elapsed time: %d seconds\n", (int)elapsed_seconds);
+    printf("\nReplayed %lu scans, %lu of them with a different TDO\n", total, mismatches);
+    printf("    %-6s %10s %12s %12s %8s\n", "kind", "scans", "recorded s", "replayed s", "speedup");
+    for (kind = 0; kind < TRACE_KINDS; kind++)
+    {
+        if (!scans[kind]) continue;
+        printf("    %-6s %10lu %12.3f %12.3f %8.2f\n", kind_name[kind], scans[kind],
+               recorded[kind] / 1e9, replayed[kind] / 1e9, replayed[kind] ? (double)recorded[kind] / replayed[kind] : 0.0);
+    }
+    printf("Time between scans in the recording (not replayed): %.3f s\n", gaps / 1e9);
 }
 
 void run_load(char *filename, unsigned int start)
 {
     unsigned int addr, data ;
+    unsigned int buf[BURST_WORDS];
+    unsigned int burst, words;
     FILE *fd ;
     int counter = 0;
     int percent_complete = 0;
     unsigned int length = 0;
-    time_t start_time = time(0);
-    time_t end_time, elapsed_seconds;
+    unsigned long long start_ns = clock_ns();
 
     printf("*** You Selected to program the %s ***\n\n",filename);
 
@@ -2236,22 +3947,33 @@ void run_load(char *filename, unsigned int start)
     printf("===============================\n");
 
     printf("\nLoading %s to RAM...\n",filename);
+    progress_start(length);
     for (addr=start; addr<(start+length); addr+=4)
     {
         counter += 4;
         percent_complete = (counter * 100 / length);
-        if (!silent_mode)
+        if (hexdump)
             if ((addr&0xF) == 0)  printf("[%3d%%]   %08x: ", percent_complete, addr);
 
-        fread( (unsigned char*) &data, 1,sizeof(data), fd);
-        ejtag_write(addr, data);
-
-        if (silent_mode)  printf("%4d%%   bytes = %d (%08x)@(%08x)=%08x\r", percent_complete, counter, counter, addr, data);
-        else              printf("%08x%c", data, (addr&0xF)==0xC?'\n':' ');
+        burst = ((addr - start) / 4) % BURST_WORDS;
+        if (burst == 0)
+        {
+            words = (start + length - addr + 3) / 4;
+            if (words > BURST_WORDS) words = BURST_WORDS;
+            memset(buf, 0xFF, sizeof(buf));  // This is in case file is shorter than expected length
+            fread(buf, 1, words * 4, fd);
+            ejtag_write_block(addr, buf, words);
+        }
+        data = buf[burst];
 
-        fflush(stdout);
-        data = 0xFFFFFFFF;  // This is in case file is shorter than expected length
+        if (hexdump)
+        {
+            printf("%08x%c", data, (addr&0xF)==0xC?'\n':' ');
+            fflush(stdout);
+        }
+        else progress_update(counter);
     }
+    progress_end();
     fclose(fd);
     printf("Done  (%s loaded into Memory OK)\n\n",filename);
 
@@ -2262,9 +3984,8 @@ void run_load(char *filename, unsigned int start)
     printf("Programming RAM Routine Complete\n");
     printf("================================\n");
 
-    time(&end_time);
-    elapsed_seconds = difftime(end_time, start_time);
-    printf("elapsed time: %d seconds\n", (int)elapsed_seconds);
+    report_step("load", start, length, start_ns);
+    printf("elapsed time: %.3f seconds\n", (clock_ns() - start_ns) / 1e9);
 
     /*
         printf("Resuming Processor ... ");
@@ -2464,17 +4185,49 @@ again:
 
 void sflash_poll(unsigned int addr, unsigned int data)
 {
+    USDT2(sflash_poll__entry, addr, data);
+
     if ((cmd_type == CMD_TYPE_BSC) || (cmd_type == CMD_TYPE_SCS))
     {
         // Wait Until Ready
+        do cost[cost_phase].polls++;
         while ( (ejtag_read_h(FLASH_MEMORY_START) & STATUS_READY) != STATUS_READY );
     }
     else
     {
         // Wait Until Ready
+        do cost[cost_phase].polls++;
         while ( (ejtag_read_h(addr) & STATUS_READY) != (data & STATUS_READY) );
     }
 
+    USDT1(sflash_poll__return, addr);
+
+}
+
+
+// AMD data# polling: 0 once DQ7 reads as in data, -1 if any of the
+// fail bits (DQ5 exceeded timing limits, DQ1 buffer abort) comes up first
+int sflash_poll_dq7(unsigned int addr, unsigned int data, unsigned int fail)
+{
+    unsigned int status;
+
+    USDT2(sflash_poll__entry, addr, data);
+
+    do
+    {
+        cost[cost_phase].polls++;
+        status = ejtag_read_h(addr);
+        if ((status & STATUS_READY) == (data & STATUS_READY)) break;
+    }
+    while (!(status & fail));
+
+    // DQ7 may have turned along with the fail bits
+    if ((status & STATUS_READY) != (data & STATUS_READY))
+        status = ejtag_read_h(addr);
+
+    USDT1(sflash_poll__return, addr);
+
+    return ((status & STATUS_READY) == (data & STATUS_READY)) ? 0 : -1;
 }
 
 
@@ -2482,8 +4235,11 @@ void sflash_erase_area(unsigned int start, unsigned int length)
 {
     int cur_block;
     int tot_blocks;
+    int last, n;
     unsigned int reg_start;
     unsigned int reg_end;
+    unsigned int end;
+    unsigned long long step;
 
     reg_start = start;
     reg_end   = reg_start + length;
@@ -2497,6 +4253,23 @@ void sflash_erase_area(unsigned int start, unsigned int length)
     }
 
     printf("Total Blocks to Erase: %d\n\n", tot_blocks);
+    cost_enter(PHASE_ERASE);
+
+    // Every block there is: one chip erase instead of a command per block
+    // (Intel parts have none)
+    if (tot_blocks && (tot_blocks == block_total) && !force_nochiperase &&
+        ((cmd_type == CMD_TYPE_AMD) || (cmd_type == CMD_TYPE_SST) || (cmd_type == CMD_TYPE_SPI)))
+    {
+        printf("Erasing whole chip (addr = %08x-%08x)...", blocks[1], FLASH_MEMORY_START + flash_size - 1);
+        fflush(stdout);
+        step = clock_ns();
+        chip_erase();
+        report_step("erase", blocks[1], flash_size, step);
+        cost[PHASE_ERASE].bytes += flash_size;
+        printf("Done\n");
+        fflush(stdout);
+        return;
+    }
 
     for (cur_block = 1;  cur_block <= block_total;  cur_block++)
     {
@@ -2504,20 +4277,82 @@ void sflash_erase_area(unsigned int start, unsigned int length)
 
         if ((block_addr >= reg_start) && (block_addr < reg_end))
         {
+            step = clock_ns();
 
-            printf("Erasing block: %d (addr = %08x)...", cur_block, block_addr);
+            // AMD: the blocks after it go along for as long as the sector erase timeout lets them
+            n = 1;
+            if (cmd_type == CMD_TYPE_AMD)
+            {
+                for (last = cur_block; (last < block_total) && (blocks[last + 1] < reg_end); last++);
+                n = sflash_erase_queue(cur_block, last - cur_block + 1);
+            }
+
+            if (n > 1)
+                printf("Erasing blocks: %d-%d (addr = %08x-%08x)...", cur_block, cur_block + n - 1, block_addr, blocks[cur_block + n - 1]);
+            else
+                printf("Erasing block: %d (addr = %08x)...", cur_block, block_addr);
             fflush(stdout);
-            sflash_erase_block(block_addr);
+
+            if (cmd_type == CMD_TYPE_AMD)
+            {
+                // Wait for Erase Completion
+                sflash_poll(block_addr, 0xFFFF);
+                sflash_reset();
+            }
+            else
+                sflash_erase_block(block_addr);
+
+            end = flash_block_end(blocks[cur_block + n - 1]);
+            report_step("erase", block_addr, end - block_addr, step);
+            cost[PHASE_ERASE].bytes += end - block_addr;
             printf("Done\n");
             fflush(stdout);
+
+            cur_block += n - 1;
         }
     }
 
 }
 
 
+// AMD: start a sector erase on blocks[first], then add the count - 1
+// blocks after it for as long as the sector erase timeout stays open.
+// DQ3 is read after each 0x30, so the next one is only written while
+// it is known to be low.  When it reads high, the block written last
+// may or may not have made it; it is left for the next call, and so
+// may be erased twice.  The erase is left running; returns how many
+// blocks it is known to cover.
+int sflash_erase_queue(int first, int count)
+{
+    int n;
+
+    USDT2(sflash_erase_queue__entry, blocks[first], count);
+
+    //Unlock Block
+    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00AA00AA);
+    ejtag_write_h(FLASH_MEMORY_START+(0x2AA << 1), 0x00550055);
+    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00800080);
+
+    //Erase Block
+    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00AA00AA);
+    ejtag_write_h(FLASH_MEMORY_START+(0x2AA << 1), 0x00550055);
+    ejtag_write_h(blocks[first], 0x00300030);
+
+    for (n = 1; n < count; n++)
+    {
+        ejtag_write_h(blocks[first + n], 0x00300030);
+        cost[cost_phase].polls++;
+        if (ejtag_read_h(blocks[first]) & 0x0008) break;
+    }
+
+    USDT2(sflash_erase_queue__return, blocks[first], n);
+    return n;
+}
+
 void sflash_erase_block(unsigned int addr)
 {
+    USDT1(sflash_erase_block__entry, addr);
+
     if (cmd_type == CMD_TYPE_SPI)
     {
         spiflash_erase_block(addr);
@@ -2586,25 +4421,51 @@ void sflash_erase_block(unsigned int addr)
 
     sflash_reset();
 
+    USDT1(sflash_erase_block__return, addr);
 }
 
-void chip_erase(void)
+// Erase the whole chip with its one chip erase command and wait for it.
+// Returns 0 once done, -1 if the flash has no such command (Intel).
+int chip_erase(void)
 {
+    if ((cmd_type == CMD_TYPE_AMD) || (cmd_type == CMD_TYPE_SST))
+    {
+        unsigned int unlock1 = (cmd_type == CMD_TYPE_SST) ? 0x5555 : 0x555;
+        unsigned int unlock2 = (cmd_type == CMD_TYPE_SST) ? 0x2AAA : 0x2AA;
 
-    printf("Chip Erase\n");
+        //Unlock Chip
+        ejtag_write_h(FLASH_MEMORY_START+(unlock1 << 1), 0x00AA00AA);
+        ejtag_write_h(FLASH_MEMORY_START+(unlock2 << 1), 0x00550055);
+        ejtag_write_h(FLASH_MEMORY_START+(unlock1 << 1), 0x00800080);
 
-//    FLASH_MEMORY_START = (0x1fc0000);
-    //Unlock Block
-    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00AA00AA);
-    ejtag_write_h(FLASH_MEMORY_START+(0x2AA << 1), 0x00550055);
-    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00800080);
+        //Erase Chip
+        ejtag_write_h(FLASH_MEMORY_START+(unlock1 << 1), 0x00AA00AA);
+        ejtag_write_h(FLASH_MEMORY_START+(unlock2 << 1), 0x00550055);
+        ejtag_write_h(FLASH_MEMORY_START+(unlock1 << 1), 0x00100010);
 
-    //Erase Block
-    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00AA00AA);
-    ejtag_write_h(FLASH_MEMORY_START+(0x2AA << 1), 0x00550055);
+        // Wait for Erase Completion
+        sflash_poll(FLASH_MEMORY_START, 0xFFFF);
+        sflash_reset();
+        return 0;
+    }
 
-    ejtag_write_h(0x1fc00000, 0x00100010);
+    if (cmd_type == CMD_TYPE_SPI)
+    {
+        // Bulk erase, through the ChipCommon controller on Broadcom
+        if (bcmproc)
+            spi_chiperase(0);
+        else
+        {
+            spiflash_sendcmd(SPI_WRITE_ENABLE);
+            spiflash_sendcmd(SPI_BULK_ERASE);
+        }
+
+        /* wait for 'write in progress' to clear */
+        while (spiflash_sendcmd(bcmproc ? BCM_SPI_RD_STATUS : SPI_RD_STATUS) & SPI_STATUS_WIP);
+        return 0;
+    }
 
+    return -1;
 }
 
 void sflash_reset(void)
@@ -2654,29 +4515,30 @@ void sflash_write_word(unsigned int addr, unsigned int data)
     if (cmd_type == CMD_TYPE_AMD)
     {
 
-        if (bypass)
+        if (bypass_mode)
         {
-            if (proc_id == 0x00000001)
+            // Unlock Bypass: A0 and the data, polled for like any other program
+            // (Atheros takes the halves the other way round)
+            unsigned int lo_addr = (proc_id == 0x00000001) ? addr + 2 : addr;
+            unsigned int hi_addr = (proc_id == 0x00000001) ? addr : addr + 2;
+
+            ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00A000A0);
+            ejtag_write_h(lo_addr, data_lo);
+            if (sflash_poll_dq7(lo_addr, (data & 0xffff), 0x0020) == 0)
             {
                 ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00A000A0);
-                ejtag_write_h(addr+2, data_lo);
-                tnano(100);
-
-
-                ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00A000A0);
-                ejtag_write_h(addr, data_hi);
-                tnano(100);
+                ejtag_write_h(hi_addr, data_hi);
+                if (sflash_poll_dq7(hi_addr, ((data >> 16) & 0xffff), 0x0020) == 0)
+                    return;
             }
-            else
-            {
-
-                ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00A000A0);
-                ejtag_write_h(addr, data_lo);
 
-                ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00A000A0);
-                ejtag_write_h(addr+2, data_hi);
-
-            }
+            // DQ5: the chip now only takes Reset, which puts it back in Unlock
+            // Bypass, so leave that next and program the rest the long way.
+            // This word is not retried, sflash_poll() would wait on it forever.
+            printf("\n*** Programming %08x failed, leaving Unlock Bypass mode ***\n", addr);
+            sflash_reset();
+            unlock_bypass_reset();
+            failed_words++;
         }
         else
 
@@ -2770,6 +4632,128 @@ void sflash_write_word(unsigned int addr, unsigned int data)
     }
 }
 
+// Write-to-Buffer: the words, all within one write_buffer page, go in
+// with a single command and are polled for once.  AMD/Spansion parts are
+// polled right away and, should the chip abort the buffer, programmed a
+// word at a time instead.  Intel parts are left programming: the next
+// Write to Buffer Command waits for them and sflash_buffer_check() looks
+// at the status once the block is done.
+void sflash_write_buffer(unsigned int addr, unsigned int *data, unsigned int words)
+{
+    unsigned int i, count, poll, last, tries;
+    int intel = (cmd_type == CMD_TYPE_BSC) || (cmd_type == CMD_TYPE_SCS);
+
+    if (!words) return;
+
+    count = words * 2 - 1;      // halfwords to load, less one
+    poll  = addr + words * 4 - 2;
+    last  = (data[words - 1] >> 16) & 0xffff;
+
+    // The write buffer was given up on below
+    if (force_nobuffer)
+    {
+        for (i = 0; i < words; i++)
+            sflash_write_word(addr + 4 * i, data[i]);
+        return;
+    }
+
+    if (intel)
+    {
+        // XSR.7 tells whether the write buffer is free, ask again until it
+        // is.  A chip that never says so does not really have one, whatever
+        // its CFI claims.
+        for (tries = 0; tries < WRITE_BUFFER_TRIES; tries++)
+        {
+            cost[cost_phase].polls++;
+            ejtag_write_h(addr, 0x00E800E8);       // Write to Buffer Command
+            if (ejtag_read_h(addr) & STATUS_READY) break;
+        }
+
+        if (tries == WRITE_BUFFER_TRIES)
+        {
+            ejtag_write_h(addr, 0x00FF00FF);       // Read Array Command
+            printf("\n*** Write buffer at %08x never came free, programming a word at a time from here on ***\n", addr);
+            force_nobuffer = 1;
+            for (i = 0; i < words; i++)
+                sflash_write_word(addr + 4 * i, data[i]);
+            return;
+        }
+    }
+    else
+    {
+        ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00AA00AA);
+        ejtag_write_h(FLASH_MEMORY_START+(0x2AA << 1), 0x00550055);
+        ejtag_write_h(addr, 0x00250025);           // Write to Buffer Command
+    }
+
+    ejtag_write_h(addr, (count << 16) | count);    // Halfword Count - 1
+
+    for (i = 0; i < words; i++)
+    {
+        // DMA uses byte lanes, PrAcc does not
+        ejtag_write_h(addr + 4 * i,     USE_DMA ? data[i] : (data[i] & 0xffff));
+        ejtag_write_h(addr + 4 * i + 2, USE_DMA ? data[i] : ((data[i] >> 16) & 0xffff));
+    }
+
+    if (intel)
+    {
+        ejtag_write_h(addr, 0x00D000D0);           // Confirm Command
+        return;
+    }
+
+    ejtag_write_h(addr, 0x00290029);               // Program Buffer to Flash
+
+    // Wait for Completion on the last halfword loaded, unless DQ5 (timeout)
+    // or DQ1 (buffer abort) comes up first
+    if (sflash_poll_dq7(poll, last, 0x0022) == 0) return;
+
+    // Write-to-Buffer Abort Reset
+    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00AA00AA);
+    ejtag_write_h(FLASH_MEMORY_START+(0x2AA << 1), 0x00550055);
+    ejtag_write_h(FLASH_MEMORY_START+(0x555 << 1), 0x00F000F0);
+
+    printf("\n*** Write buffer at %08x aborted, programming it a word at a time ***\n", addr);
+    for (i = 0; i < words; i++)
+        sflash_write_word(addr + 4 * i, data[i]);
+}
+
+// Intel: wait for the last buffer of a block to finish and check the
+// error bits, which stay set, once for all the buffers that went into it.
+// Returns -1 if any of them failed.
+int sflash_buffer_check(unsigned int addr)
+{
+    unsigned int status;
+
+    if ((cmd_type != CMD_TYPE_BSC) && (cmd_type != CMD_TYPE_SCS)) return 0;
+
+    ejtag_write_h(FLASH_MEMORY_START, 0x00700070);     // Read Status Command
+    sflash_poll(addr, STATUS_READY);
+
+    status = ejtag_read_h(FLASH_MEMORY_START) & 0xff;
+    if (status & 0x3A)
+        printf("\n*** Programming block at %08x failed, status %02x%s%s ***\n", addr, status,
+               (status & 0x08) ? ", VPP low" : "", (status & 0x02) ? ", block locked" : "");
+
+    ejtag_write_h(FLASH_MEMORY_START, 0x00500050);     // Clear Status Command
+
+    return (status & 0x3A) ? -1 : 0;
+}
+
+// Write buffer size in bytes from the CFI query, 0 if the chip gives none
+unsigned int sflash_cfi_buffer(void)
+{
+    unsigned int n = 0;
+
+    ejtag_write_h(FLASH_MEMORY_START + (0x55 << 1), 0x00980098);   // CFI Query Command
+    if (((ejtag_read_h(FLASH_MEMORY_START + (0x10 << 1)) & 0xff) == 'Q') &&
+        ((ejtag_read_h(FLASH_MEMORY_START + (0x11 << 1)) & 0xff) == 'R') &&
+        ((ejtag_read_h(FLASH_MEMORY_START + (0x12 << 1)) & 0xff) == 'Y'))
+        n = ejtag_read_h(FLASH_MEMORY_START + (0x2A << 1)) & 0xff;  // 2^n bytes per buffer
+
+    sflash_reset();
+    return ((n >= 2) && (n < 16)) ? (1 << n) : 0;     // less than a word is no buffer
+}
+
 
 
 
@@ -2796,7 +4780,8 @@ void show_usage(void)
 
     printf( "\n\n");
     printf( " USAGE: tjtag [parameter] </noreset> </noemw> </nocwd> </nobreak> </noerase>\n"
-            "                      </notimestamp> </dma> </nodma>\n"
+            "                      </notimestamp> </dma> </nodma> </noall> </nobuffer> </fastdata>\n"
+            "                      </workarea:XXXXXXXX>\n"
             "                      <start:XXXXXXXX> </length:XXXXXXXX>\n"
             "                      </silent> </skipdetect> </instrlen:XX> </fc:XX> /bypass /st5\n\n"
 
@@ -2822,6 +4807,7 @@ void show_usage(void)
             "            -flash:bsp\n"
             "            -probeonly\n"
             "            -probeonly:custom\n"
+            "            -replay:FILE ....... shift a /trace file again and compare TDO and timing\n"
             " and for Ti AR7 \n"
             "            -backup:mtd2\n"
             "            -backup:mtd3\n"
@@ -2845,18 +4831,40 @@ void show_usage(void)
             "            /nocwd ............. prevent Clearing CPU Watchdog Timer\n"
             "            /nobreak ........... prevent Issuing Debug Mode JTAGBRK\n"
             "            /noerase ........... prevent Forced Erase before Flashing\n"
+            "            /nochiperase ....... erase block by block even when the whole chip is erased\n"
             "            /notimestamp ....... prevent Timestamping of Backups\n"
+            "            /verify ............ read the flash back after Flashing and compare\n"
+            "            /trace:FILE ........ log every IR and DR scan to FILE, see -replay\n"
+            "            /vcd:FILE .......... record TCK/TMS/TDI/TDO edges to FILE for GTKWave\n"
+            "            /report:FILE ....... write per-step timings and throughput to FILE as JSON\n"
             "            /dma ............... force use of DMA routines\n"
             "            /nodma ............. force use of PRACC routines (No DMA)\n"
+            "            /noall ............. DMA one register at a time instead of through ALL\n"
+            "            /nobuffer .......... program flash a word at a time, no Write-to-Buffer\n"
+            "            /fastdata .......... PrAcc block transfers through FASTDATA (EJTAG 2.6+)\n"
+            "            /workarea:XXXXXXXX . target RAM for the FASTDATA handler (default A0000800)\n"
             "            /window:XXXXXXXX ... custom flash window base (in HEX)\n"
             "            /start:XXXXXXXX .... custom start location (in HEX)\n"
             "            /length:XXXXXXXX ... custom length (in HEX)\n"
-            "            /silent ............ prevent scrolling display of data\n"
+            "            /silent ............ no progress display at all\n"
+            "            /hexdump ........... show every word moved instead of the progress line\n"
+            "            /progress:HZ ....... redraw the progress line at most HZ times a second (default 4)\n"
             "            /skipdetect ........ skip auto detection of CPU Chip ID\n"
             "            /instrlen:XX ....... set instruction length manually\n"
             "            /wiggler ........... use wiggler cable\n"
-            "            /bypass ............ Unlock Bypass command & disable polling\n"
+            "            /ioport ............ drive the parallel port with direct I/O (Linux x86, root)\n"
+            "            /realtime[:CPU] .... SCHED_FIFO, locked memory, pinned to CPU (default last)\n"
+#ifdef SIM
+            "            /simimage:FILE ..... keep the simulated flash in FILE between runs\n"
+            "            /simlatency:N ...... TCK cycles a simulated DMA access stays busy\n"
+            "            /simflash:XXX ...... simulated flash: amd, sst, bsc, scs, spi, s29gl, eon (default amd)\n"
+            "            /simtck:XXXX ....... TCK in kHz the simulated flash timings run against (default 1000)\n"
+#endif
+            "            /bypass ............ Unlock Bypass programming on any AMD type flash\n"
+            "            /nobypass .......... no Unlock Bypass, even where the flash is known to have it\n"
             "            /delay:XXXXXX ...... add delay to communication\n"
+            "            /tck:XXXX .......... calibrate TCK to XXXX kHz (overrides /delay)\n"
+            "            /autospeed ......... find the fastest error-free TCK (overrides /tck)\n"
             "            /st5 ............... Use Speedtouch ST5xx flash routines instead of WRT routines\n"
             "            /reboot............. sets the process and reboots\n"
 	        "		 /swap_endian........ swap endianess during backup - most Atheros based routers\n"
@@ -2889,8 +4897,8 @@ void show_usage(void)
             "           out, then plug in the router, and then hit <ENTER> quickly to avoid\n"
             "           the CPUs watchdog interfering with the EJTAG operations.\n\n"
 
-            "        5) /bypass - enables Unlock bypass command for some AMD/Spansion type\n"
-            "           flashes, it also disables polling\n\n"
+            "        5) Unlock bypass is used on its own with the AMD/Spansion type flashes\n"
+            "           known to have it, /bypass turns it on for the others, /nobypass off\n\n"
 
             " ***************************************************************************\n"
             " * Flashing the KERNEL or WHOLEFLASH will take a very long time using JTAG *\n"
@@ -2905,6 +4913,7 @@ int main(int argc, char** argv)
     char choice[128];
     int run_option;
     int j;
+    unsigned long long step;
 
     printf("\n");
     printf("==============================================\n");
@@ -3119,6 +5128,12 @@ int main(int argc, char** argv)
         strcpy(AREA_NAME, &choice[6]);
     }
 
+    if (strncasecmp(choice,"-replay:",8)==0)
+    {
+        run_option = 7;
+        strcpy(AREA_NAME, &choice[8]);
+    }
+
 /* Extras for AR7 */
     if (strcasecmp(choice,"-backup:mtd2")==0)        { run_option = 1;  strcpy(AREA_NAME, "MTD2");       }
     if (strcasecmp(choice,"-backup:mtd3")==0)        { run_option = 1;  strcpy(AREA_NAME, "MTD3");       }
@@ -3156,9 +5171,19 @@ int main(int argc, char** argv)
             else if (strcasecmp(choice,"/notimestamp")==0)     issue_timestamp = 0;
             else if (strcasecmp(choice,"/dma")==0)             force_dma = 1;
             else if (strcasecmp(choice,"/nodma")==0)           force_nodma = 1;
+            else if (strcasecmp(choice,"/noall")==0)           force_noall = 1;
+            else if (strcasecmp(choice,"/nobuffer")==0)        force_nobuffer = 1;
+            else if (strcasecmp(choice,"/fastdata")==0)        force_fastdata = 1;
+            else if (strncasecmp(choice,"/workarea:",10)==0)   workarea = strtoul(((char *)choice + 10),NULL,16);
             else if (strncasecmp(choice,"/fc:",4)==0)          selected_fc = strtoul(((char *)choice + 4),NULL,10);
             else if (strcasecmp(choice,"/bypass")==0)          bypass = 1;
+            else if (strcasecmp(choice,"/nobypass")==0)        force_nobypass = 1;
+            else if (strcasecmp(choice,"/nochiperase")==0)     force_nochiperase = 1;
             else if (strcasecmp(choice, "/reboot")==0)         issue_reboot = 1;
+            else if (strcasecmp(choice,"/verify")==0)          issue_verify = 1;
+            else if (strncasecmp(choice,"/trace:",7)==0)       trace_name = strdup((char *)choice + 7);
+            else if (strncasecmp(choice,"/vcd:",5)==0)         vcd_name = strdup((char *)choice + 5);
+            else if (strncasecmp(choice,"/report:",8)==0)      report_name = strdup((char *)choice + 8);
             else if (strncasecmp(choice,"/window:",8)==0)
             {
                 selected_window = strtoul(((char *)choice + 8),NULL,16);
@@ -3176,12 +5201,29 @@ int main(int argc, char** argv)
                 custom_options++;
             }
             else if (strcasecmp(choice,"/silent")==0)          silent_mode = 1;
+            else if (strcasecmp(choice,"/hexdump")==0)         hexdump = 1;
+            else if (strncasecmp(choice,"/progress:",10)==0)   progress_hz = strtoul(((char *)choice + 10),NULL,10);
             else if (strcasecmp(choice,"/skipdetect")==0)      skipdetect = 1;
             else if (strncasecmp(choice,"/instrlen:",10)==0)   instrlen = strtoul(((char *)choice + 10),NULL,10);
             else if (strcasecmp(choice,"/wiggler")==0)         wiggler = 1;
+            else if (strcasecmp(choice,"/ioport")==0)          force_ioport = 1;
+#ifdef SIM
+            else if (strncasecmp(choice,"/simimage:",10)==0)   sim_image = strdup((char *)choice + 10);
+            else if (strncasecmp(choice,"/simlatency:",12)==0) sim_dma_latency = strtoul(((char *)choice + 12),NULL,10);
+            else if (strncasecmp(choice,"/simflash:",10)==0)   sim_flash_name = strdup((char *)choice + 10);
+            else if (strncasecmp(choice,"/simtck:",8)==0)      sim_tck_khz = strtoul(((char *)choice + 8),NULL,10);
+#endif
+            else if (strcasecmp(choice,"/realtime")==0)        realtime = 1;
+            else if (strncasecmp(choice,"/realtime:",10)==0)
+            {
+                realtime     = 1;
+                realtime_cpu = strtoul(((char *)choice + 10),NULL,10);
+            }
             else if (strcasecmp(choice,"/st5")==0)			   speedtouch = 1;
             else if (strcasecmp(choice,"/flash_debug")==0)     Flash_DEBUG = 1;
             else if (strncasecmp(choice,"/delay:",7)==0)       delay = strtoul(((char *)choice + 7),NULL,10);
+            else if (strncasecmp(choice,"/tck:",5)==0)         tck_khz = strtoul(((char *)choice + 5),NULL,10);
+            else if (strcasecmp(choice,"/autospeed")==0)      auto_speed = 1;
             else if (strcasecmp(choice,"/xbit")==0)            xbit = 1;
             else if (strcasecmp(choice,"/swap_endian")==0)      swap_endian = 1;
             else
@@ -3217,19 +5259,48 @@ int main(int argc, char** argv)
     // Detect CPU
     // ----------------------------------
 
+    report_start = clock_ns();
+    if (trace_name) trace_open(trace_name);
+    if (vcd_name) vcd_open(vcd_name);
+
+    if (run_option == 7)
+    {
+        run_replay(AREA_NAME);
+        chip_shutdown();
+        return 0;
+    }
+
+    cost_enter(PHASE_DETECT);
+    step = clock_ns();
     chip_detect();
+    report_step("chip_detect", 0, 0, step);
 
 
     // ----------------------------------
     // Find Implemented EJTAG Features
     // ----------------------------------
+    step = clock_ns();
     check_ejtag_features();
+    report_step("check_ejtag_features", 0, 0, step);
+
+
+    // ----------------------------------
+    // Find The Fastest Reliable TCK
+    // ----------------------------------
+    if (auto_speed)
+    {
+        step = clock_ns();
+        speed_autotune();
+        report_step("autospeed", 0, 0, step);
+    }
 
 
 
     // ----------------------------------
     // Reset State Machine For Good Measure
     // ----------------------------------
+    cost_enter(PHASE_HALT);
+    step = clock_ns();
     test_reset();
 
 
@@ -3268,11 +5339,13 @@ int main(int argc, char** argv)
         printf("Done\n");
     }
     else printf("Skipped\n");
+    report_step("reset", 0, 0, step);
 
 
     // ----------------------------------
     // Put into EJTAG Debug Mode
     // ----------------------------------
+    step = clock_ns();
     printf("Halting Processor ... ");
     if (issue_break)
     {
@@ -3285,12 +5358,14 @@ int main(int argc, char** argv)
         printf("Done\n");
     }
     else printf("Skipped\n");
+    report_step("halt", 0, 0, step);
 
 
     // ----------------------------------
     // Clear Watchdog
     // ----------------------------------
 
+    step = clock_ns();
     printf("Clearing Watchdog ... ");
 
     if (issue_watchdog)
@@ -3313,8 +5388,11 @@ int main(int argc, char** argv)
         }
     }
     else printf("Skipped\n");
+    report_step("watchdog", 0, 0, step);
 
 
+    cost_enter(PHASE_PROBE);
+    step = clock_ns();
     isbrcm();
     //mscan();
 
@@ -3370,6 +5448,7 @@ int main(int argc, char** argv)
         sflash_config();
     else
         sflash_probe();
+    report_step("sflash_probe", 0, 0, step);
 
 
     // ----------------------------------
@@ -3385,7 +5464,15 @@ int main(int argc, char** argv)
     }
 
     if (run_option == 5 )  run_load(AREA_NAME, 0x80040000);
-    if (run_option == 6 )  spi_chiperase(0x1fc00000);
+    if (run_option == 6 )
+    {
+        if (cmd_type == CMD_TYPE_SPI) chip_erase();
+        else spi_chiperase(0x1fc00000);
+    }
+
+    // Put back whatever the FASTDATA handler was sitting on
+    cost_enter(PHASE_HALT);
+    ejtag_fastdata_release();
 
 
     printf("\n\n *** REQUESTED OPERATION IS COMPLETE ***\n\n");
@@ -3426,7 +5513,7 @@ int main(int argc, char** argv)
 
     chip_shutdown();
 
-    return 0;
+    return run_failed;
 }
 
 
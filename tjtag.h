@@ -30,6 +30,8 @@
 
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #ifdef __FreeBSD__
 #include <dev/ppbus/ppi.h>
@@ -38,6 +40,10 @@
 #define PPRSTATUS PPIGSTATUS
 #else
 #include <linux/ppdev.h>
+#if !defined(RASPPI) && (defined(__i386__) || defined(__x86_64__))
+#include <sys/io.h>
+#define LPT_PORTIO      // ioperm()/outb()/inb() straight to the port
+#endif
 #endif
 #endif
 /*
@@ -50,6 +56,31 @@
    #include <sys/mman.h>
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#define REALTIME_PRIORITY   50      // SCHED_FIFO, below the kernel's IRQ threads
+
+// USDT probes (provider "tjtag") for perf and bpftrace, e.g.
+//   bpftrace -e 'usdt:./tjtag:tjtag:dma_read__entry { ... }'
+// Each is a single nop in the binary, and nothing at all without sys/sdt.h.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TJTAG_USDT
+#endif
+#endif
+
+#ifdef TJTAG_USDT
+#define USDT1(name, a)              DTRACE_PROBE1(tjtag, name, a)
+#define USDT2(name, a, b)           DTRACE_PROBE2(tjtag, name, a, b)
+#else
+#define USDT1(name, a)              do { } while (0)
+#define USDT2(name, a, b)           do { } while (0)
+#endif
+
 #define TRUE  1
 #define FALSE 0
 
@@ -77,6 +108,9 @@
 #define TEST    0x0001
 
 #define RETRY_ATTEMPTS 16
+#define BURST_WORDS    256     // words moved per ejtag_read_block()/ejtag_write_block() in backups and loads
+#define WRITE_BUFFER_MAX 512   // largest flash write buffer, in bytes, sflash_write_buffer() takes
+#define WRITE_BUFFER_TRIES 1024 // Intel: times to ask for a free write buffer before giving up on it
 
 /*
 kuseg   0x00000000 - 0x7fffffff  User virtual mem,  mapped
@@ -136,6 +170,91 @@ kseg2   0xc0000000 - 0xffffffff  kernel-virtual,  mapped
 #define TMS_MASK  0x04
 #define TDI_MASK  0x01
 
+// --- TAP Controller States ---
+#define TAP_UNKNOWN     -1
+#define TAP_RESET       0
+#define TAP_IDLE        1
+#define TAP_DRSELECT    2
+#define TAP_DRCAPTURE   3
+#define TAP_DRSHIFT     4
+#define TAP_DREXIT1     5
+#define TAP_DRPAUSE     6
+#define TAP_DREXIT2     7
+#define TAP_DRUPDATE    8
+#define TAP_IRSELECT    9
+#define TAP_IRCAPTURE   10
+#define TAP_IRSHIFT     11
+#define TAP_IREXIT1     12
+#define TAP_IRPAUSE     13
+#define TAP_IREXIT2     14
+#define TAP_IRUPDATE    15
+#define TAP_STATES      16
+
+// --- Scan Vectors (bit 0 of byte 0 is clocked first) ---
+#define MAX_SCAN_BITS   160
+#define SCAN_BYTES(n)   (((n) + 7) >> 3)
+#define SCAN_GET(v, i)  (((v)[(i) >> 3] >> ((i) & 7)) & 1)
+#define SCAN_SET(v, i)  ((v)[(i) >> 3] |= 1 << ((i) & 7))
+
+// --- Phases the JTAG cost counters are charged to ---
+#define PHASE_DETECT    0
+#define PHASE_HALT      1
+#define PHASE_PROBE     2
+#define PHASE_BACKUP    3
+#define PHASE_ERASE     4
+#define PHASE_PROGRAM   5
+#define PHASE_VERIFY    6
+#define PHASES          7
+
+// --- /trace files: TRACE_MAGIC, then one record per shift_bits() call: a
+// kind byte, the length in bits, the ns from the end of the previous
+// record to the start of this one and the ns the shift itself took (all
+// three 32 bit little endian), then SCAN_BYTES(length) bytes each of TMS,
+// TDI and TDO ---
+#define TRACE_MAGIC     "TJTR\002"
+#define TRACE_HEAD      13
+#define TRACE_MAX_BITS  (1 << 24)
+#define TRACE_DR        0       // shifted in Shift-DR
+#define TRACE_IR        1       // shifted in Shift-IR
+#define TRACE_TMS       2       // anything else: TAP moves, resets, idle clocks
+#define TRACE_KINDS     3
+
+// --- /vcd capture: the pins as seen at each edge, see vcd_flush() ---
+#define VCD_TCK         0x01
+#define VCD_TMS         0x02
+#define VCD_TDI         0x04
+#define VCD_TDO         0x08
+#define VCD_SAMPLED     0x10    // TDO was read at this point, otherwise it is unchanged
+#define VCD_RING        65536   // edges buffered between flushes, a power of 2
+
+struct vcd_event
+{
+    unsigned long long  ns;
+    unsigned int        lines;
+};
+
+// --- /report: one timed step of the run, a startup step or one block ---
+struct report_step
+{
+    const char         *name;
+    unsigned int        addr;
+    unsigned int        bytes;
+    unsigned long long  ns;
+};
+
+struct jtag_cost
+{
+    unsigned long long  tck;            // TCK cycles shifted
+    unsigned long long  ir_scans;       // IR scans shifted
+    unsigned long long  dr_scans;       // DR scans shifted
+    unsigned long long  ir_cached;      // set_instr() calls the IR already held
+    unsigned long long  dma_retries;    // DMA accesses redone after DERR
+    unsigned long long  pracc;          // PrAcc and FASTDATA accesses served
+    unsigned long long  polls;          // flash and SPI controller status reads
+    unsigned long long  bytes;          // flash bytes backed up, erased, programmed or verified
+    unsigned long long  ns;             // time spent in the phase
+};
+
 // --- Some EJTAG Instruction Registers ---
 #define INSTR_EXTEST    0x00
 #define INSTR_IDCODE    0x01
@@ -255,6 +374,8 @@ kseg2   0xc0000000 - 0xffffffff  kernel-virtual,  mapped
 #define  CMD_TYPE_SST  0x04
 #define  CMD_TYPE_SPI  0x05
 
+#define  FLASH_F_BYPASS  0x0001     // AMD Unlock Bypass (0x20), A0 and the data per word
+
 #define  STATUS_READY  0x0080
 #define MaxIR_ChainLength 1000
 
@@ -263,11 +384,16 @@ kseg2   0xc0000000 - 0xffffffff  kernel-virtual,  mapped
 // Our 'Pseudo' Virtual Memory Access Registers
 #define MIPS_VIRTUAL_ADDRESS_ACCESS         0xFF200000
 #define MIPS_VIRTUAL_DATA_ACCESS            0xFF200004
+// Processor accesses up to here are answered through FASTDATA
+#define MIPS_FASTDATA_AREA_END              0xFF20000F
 
 // Bit PRNW is not implemented into the all processors with EJTAG ver. < 2.5 ( for example BCM5354 rev.3 is not ).
 // Therefore added new address 0xFF200008 for the story data and modified all read debug modules
 #define MIPS_VIRTUAL_DATA_STORY_ACCESS		0xFF200008
 
+// Word count for the block modules, whose data goes through MIPS_VIRTUAL_DATA_ACCESS
+#define MIPS_VIRTUAL_COUNT_ACCESS           0xFF20000C
+
 
 
 /* breakpoint support */
@@ -354,10 +480,17 @@ unsigned stat_wsms:
 void sflash_write_byte(unsigned int addr, unsigned int data);
 void chip_detect(void);
 void chip_shutdown(void);
-static unsigned char clockin(int tms, int tdi);
+static void cable_select(void);
+static double tck_period_ns(void);
+static unsigned long long clock_ns(void);
+static void shift_bits(const unsigned char *tms_vec, const unsigned char *tdi_vec, unsigned char *tdo_vec, int nbits);
+static void jtag_scan(int ir, const unsigned char *in_vec, unsigned char *out_vec, int nbits);
+static void tap_goto(int state);
 void define_block(unsigned int block_count, unsigned int block_size);
 static unsigned int ejtag_read(unsigned int addr);
 static unsigned int ejtag_read_h(unsigned int addr);
+static void ejtag_read_block(unsigned int addr, unsigned int *buf, int count);
+static void ejtag_write_block(unsigned int addr, unsigned int *buf, int count);
 //static unsigned int ejtag_read_b(unsigned int addr);
 void ejtag_write(unsigned int addr, unsigned int data);
 void ejtag_write_h(unsigned int addr, unsigned int data);
@@ -368,12 +501,23 @@ static unsigned int ejtag_dma_read_h(unsigned int addr);
 void ejtag_dma_write(unsigned int addr, unsigned int data);
 void ejtag_dma_write_h(unsigned int addr, unsigned int data);
 void ejtag_dma_write_b(unsigned int addr, unsigned int data);
+static unsigned int ejtag_all_scan(unsigned int addr, unsigned int data, unsigned int ctrl, unsigned int *data_out);
+static void ejtag_dma_settle(void);
+static void ejtag_dma_burst(unsigned int addr, unsigned int *buf, int count, int write);
+static int ejtag_fastdata_scan(unsigned int in_data, unsigned int *out_data);
+static int ejtag_fastdata_xfer(unsigned int in_data, unsigned int *out_data);
+static void ejtag_fastdata_enter(unsigned int *pmodule, int words);
+static int ejtag_fastdata_stop(const unsigned int *header, int done, int total);
+static int ejtag_fastdata_block(unsigned int addr, unsigned int *buf, int count, int write);
+void ejtag_fastdata_release(void);
 static unsigned int ejtag_pracc_read(unsigned int addr);
 static unsigned int ejtag_pracc_read_h(unsigned int addr);
 //static unsigned int ejtag_pracc_read_b(unsigned int addr);
 void ejtag_pracc_write(unsigned int addr, unsigned int data);
 void ejtag_pracc_write_h(unsigned int addr, unsigned int data);
 void ejtag_pracc_write_b(unsigned int addr, unsigned int data);
+void ejtag_pracc_read_block(unsigned int addr, unsigned int *buf, int count);
+void ejtag_pracc_write_block(unsigned int addr, unsigned int *buf, int count);
 void identify_flash_part(void);
 void lpt_closeport(void);
 void lpt_openport(void);
@@ -386,9 +530,15 @@ void set_instr(int instr);
 void sflash_config(void);
 void sflash_erase_area(unsigned int start, unsigned int length);
 void sflash_erase_block(unsigned int addr);
+int sflash_erase_queue(int first, int count);
+int chip_erase(void);
 void sflash_probe(void);
 void sflash_reset(void);
 void sflash_write_word(unsigned int addr, unsigned int data);
+void sflash_write_buffer(unsigned int addr, unsigned int *data, unsigned int words);
+int sflash_poll_dq7(unsigned int addr, unsigned int data, unsigned int fail);
+int sflash_buffer_check(unsigned int addr);
+unsigned int sflash_cfi_buffer(void);
 void show_usage(void);
 void ShowData(unsigned int value);
 void test_reset(void);
@@ -399,6 +549,34 @@ void unlock_bypass(void);
 void unlock_bypass_reset(void);
 void spi_fast(unsigned int addr);
 void cable_wait( void );
+void tck_calibrate(void);
+void speed_autotune(void);
+void dma_backoff(int retries);
+void realtime_enter(void);
+void realtime_report(void);
+void cost_enter(int phase);
+void cost_report(void);
+void run_verify(char *filename, unsigned int start, unsigned int length);
+void run_replay(char *filename);
+void trace_open(char *filename);
+void trace_close(void);
+static unsigned char *trace_tdo(int nbits);
+static void trace_shift(const unsigned char *tms_vec, const unsigned char *tdi_vec, const unsigned char *tdo_vec,
+                        int nbits, unsigned long long start, unsigned long long end);
+void report_step(const char *name, unsigned int addr, unsigned int bytes, unsigned long long start);
+void report_write(void);
+unsigned int flash_block_end(unsigned int addr);
+void swap_words(unsigned int *buf, unsigned int count);
+void progress_start(unsigned int total);
+void progress_update(unsigned int done);
+void progress_end(void);
+void vcd_open(char *filename);
+void vcd_close(void);
+static int vcd_flush(void);
+static void vcd_wait(void);
+#ifndef WINDOWS_VERSION
+static void *vcd_writer(void *arg);
+#endif
 
 
 unsigned int pracc_readbyte_code_module[] =
@@ -743,6 +921,121 @@ unsigned int pracc_writeword_new[] =
     0x00000000
 }; // nop
 
+unsigned int pracc_readblock_code_module[] =
+{
+    // #
+    // # PrAcc Read Block Routine
+    // #
+    // start:
+    //
+    // # Load R1 with the address of the pseudo-address register
+    0x3C01FF20,  // lui $1,  0xFF20
+    //
+    // # Load R2 with the start address and R4 with the word count
+    0x8C220000,  // lw $2,  ($1)
+    0x8C24000C,  // lw $4, 12($1)
+    //
+    // loop:
+    // # Load R3 with the word @R2 and store it into the pseudo-data register
+    0x8C430000,  // lw $3, 0($2)
+    0x2484FFFF,  // addiu $4, $4, -1
+    0xAC230004,  // sw $3, 4($1)
+    0x1480FFFC,  // bne $4, $0, loop
+    0x24420004,  // addiu $2, $2, 4
+    //
+    0x1000FFF7,  // beq $0, $0, start
+    0x00000000   // nop
+};
+
+unsigned int pracc_writeblock_code_module[] =
+{
+    // #
+    // # PrAcc Write Block Routine
+    // #
+    // start:
+    //
+    // # Load R1 with the address of the pseudo-address register
+    0x3C01FF20,  // lui $1,  0xFF20
+    //
+    // # Load R2 with the start address and R4 with the word count
+    0x8C220000,  // lw $2,  ($1)
+    0x8C24000C,  // lw $4, 12($1)
+    //
+    // loop:
+    // # Load R3 from the pseudo-data register and store it @R2
+    0x8C230004,  // lw $3, 4($1)
+    0x2484FFFF,  // addiu $4, $4, -1
+    0xAC430000,  // sw $3, 0($2)
+    0x1480FFFC,  // bne $4, $0, loop
+    0x24420004,  // addiu $2, $2, 4
+    //
+    0x1000FFF7,  // beq $0, $0, start
+    0x00000000   // nop
+};
+
+// **************************************************************************
+//     FASTDATA block transfer handlers.  These are copied into target RAM
+//     (the /workarea) and run from there, so the only PrAcc handshakes left
+//     are the FASTDATA ones, one per word.  The start address and the word
+//     count are the first two words handed over through FASTDATA.
+// **************************************************************************
+
+unsigned int fastdata_read_handler[] =
+{
+    // #
+    // # FASTDATA Read Block Routine
+    // #
+    // # Load R1 with the address of the FASTDATA area
+    0x3C01FF20,  // lui $1,  0xFF20
+    //
+    // # Load R2 with the start address and R3 with the word count
+    0x8C220000,  // lw $2, 0($1)
+    0x8C230000,  // lw $3, 0($1)
+    //
+    // loop:
+    // # Hand the word @R2 to the probe
+    0x8C440000,  // lw $4, 0($2)
+    0x2463FFFF,  // addiu $3, $3, -1
+    0xAC240000,  // sw $4, 0($1)
+    0x1460FFFC,  // bne $3, $0, loop
+    0x24420004,  // addiu $2, $2, 4
+    //
+    // # Back to the debug vector
+    0x3C02FF20,  // lui $2,  0xFF20
+    0x34420200,  // ori $2,  0x0200
+    0x00400008,  // jr $2
+    0x00000000   // nop
+};
+
+unsigned int fastdata_write_handler[] =
+{
+    // #
+    // # FASTDATA Write Block Routine
+    // #
+    // # Load R1 with the address of the FASTDATA area
+    0x3C01FF20,  // lui $1,  0xFF20
+    //
+    // # Load R2 with the start address and R3 with the word count
+    0x8C220000,  // lw $2, 0($1)
+    0x8C230000,  // lw $3, 0($1)
+    //
+    // loop:
+    // # Store the word from the probe @R2
+    0x8C240000,  // lw $4, 0($1)
+    0x2463FFFF,  // addiu $3, $3, -1
+    0xAC440000,  // sw $4, 0($2)
+    0x1460FFFC,  // bne $3, $0, loop
+    0x24420004,  // addiu $2, $2, 4
+    //
+    // # Back to the debug vector
+    0x3C02FF20,  // lui $2,  0xFF20
+    0x34420200,  // ori $2,  0x0200
+    0x00400008,  // jr $2
+    0x00000000   // nop
+};
+
+#define FASTDATA_HANDLER_WORDS  (sizeof(fastdata_read_handler) / sizeof(fastdata_read_handler[0]))
+
 // **************************************************************************
 //     hugeird : add cpu init configuration code below.
 //               don't forget add point to CPU structure.